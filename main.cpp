@@ -1,11 +1,34 @@
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
 #include <numeric>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COVARIATION_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Addition holds the low-order bits lost so far with the opposite sign, so the accumulated
+// value is Sum - Addition.
 class TKahanAccumulator {
 private:
     double Sum;
@@ -17,150 +40,6290 @@ public:
     {
     }
 
-    TKahanAccumulator& operator += (const double value) {
-        const double y = value - Addition;
-        const double t = Sum + y;
-        Addition = (t - Sum) - y;
-        Sum = t;
-        return *this;
+    TKahanAccumulator& operator += (const double value) {
+        const double y = value - Addition;
+        const double t = Sum + y;
+        Addition = (t - Sum) - y;
+        Sum = t;
+        return *this;
+    }
+
+    TKahanAccumulator& operator += (const TKahanAccumulator& other) {
+        Merge(&other, 1);
+        return *this;
+    }
+
+    // Adds the sums of all the others before their compensations, so large sums cancel among
+    // themselves first and do not swallow the compensations; vector lanes are merged alike.
+    void Merge(const TKahanAccumulator* others, const size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            *this += others[i].Sum;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            *this += -others[i].Addition;
+        }
+    }
+
+    operator double() const {
+        return Sum - Addition;
+    }
+};
+
+class TDoubleDouble {
+private:
+    double High;
+    double Low;
+public:
+    TDoubleDouble(const double value = 0.)
+        : High(value)
+        , Low(0.)
+    {
+    }
+
+    TDoubleDouble& operator += (const double value) {
+        double low;
+        const double high = TwoSum(High, value, low);
+        Normalize(high, low + Low);
+        return *this;
+    }
+
+    TDoubleDouble& operator += (const TDoubleDouble& other) {
+        double highError;
+        const double high = TwoSum(High, other.High, highError);
+        double lowError;
+        const double low = TwoSum(Low, other.Low, lowError);
+        Normalize(high, highError + low);
+        Normalize(High, Low + lowError);
+        return *this;
+    }
+
+    TDoubleDouble& operator -= (const TDoubleDouble& other) {
+        return *this += -other;
+    }
+
+    TDoubleDouble& operator *= (const TDoubleDouble& other) {
+        double error;
+        const double high = TwoProduct(High, other.High, error);
+        Normalize(high, error + (High * other.Low + Low * other.High));
+        return *this;
+    }
+
+    TDoubleDouble& operator /= (const double value) {
+        const double firstQuotient = High / value;
+        double error;
+        const double product = TwoProduct(firstQuotient, value, error);
+        double remainderError;
+        const double remainder = TwoSum(High, -product, remainderError);
+        const double secondQuotient = (remainder + (remainderError - error + Low)) / value;
+        Normalize(firstQuotient, secondQuotient);
+        return *this;
+    }
+
+    TDoubleDouble operator - () const {
+        TDoubleDouble result;
+        result.High = -High;
+        result.Low = -Low;
+        return result;
+    }
+
+    operator double() const {
+        return High + Low;
+    }
+private:
+    static double TwoSum(const double a, const double b, double& error) {
+        const double sum = a + b;
+        const double bVirtual = sum - a;
+        error = (a - (sum - bVirtual)) + (b - bVirtual);
+        return sum;
+    }
+
+    static double TwoProduct(const double a, const double b, double& error) {
+        const double product = a * b;
+        error = std::fma(a, b, -product);
+        return product;
+    }
+
+    void Normalize(const double high, const double low) {
+        High = high + low;
+        Low = low - (High - high);
+    }
+};
+
+inline TDoubleDouble operator + (TDoubleDouble left, const TDoubleDouble& right) {
+    return left += right;
+}
+
+inline TDoubleDouble operator - (TDoubleDouble left, const TDoubleDouble& right) {
+    return left -= right;
+}
+
+inline TDoubleDouble operator * (TDoubleDouble left, const TDoubleDouble& right) {
+    return left *= right;
+}
+
+// bfloat16 keeps the upper half of a float32.
+struct TBFloat16 {
+    uint16_t Bits;
+
+    operator float() const {
+        const uint32_t bits = (uint32_t) Bits << 16;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+// IEEE 754 binary16.
+struct THalf {
+    uint16_t Bits;
+
+    operator float() const {
+        const uint32_t sign = (uint32_t) (Bits & 0x8000) << 16;
+        const uint32_t exponent = (Bits >> 10) & 0x1F;
+        const uint32_t mantissa = Bits & 0x3FF;
+
+        uint32_t bits;
+        if (exponent == 0x1F) {
+            bits = sign | 0x7F800000 | mantissa << 13;
+        } else if (exponent) {
+            bits = sign | (exponent + 127 - 15) << 23 | mantissa << 13;
+        } else {
+            const float subnormal = mantissa * (1.f / (1 << 24));
+            memcpy(&bits, &subnormal, sizeof(bits));
+            bits |= sign;
+        }
+
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+struct TKahanSums {
+    double SumX = 0.;
+    double SumY = 0.;
+    double SumProducts = 0.;
+};
+
+// Lane j of a vector Welford kernel sees samples j, j + Width, j + 2 * Width, ... and every
+// lane holds Count samples; the remaining count % Width samples are left to the caller.
+struct TWelfordLanes {
+    static const size_t MaxWidth = 8;
+
+    size_t Width = 1;
+    size_t Count = 0;
+    double MeanX[MaxWidth];
+    double MeanY[MaxWidth];
+    double SumProducts[MaxWidth];
+};
+
+// Replicas of a Poisson bootstrap stored column-wise, Count rounded up to a whole number of
+// vector lanes. Every replica draws its Poisson(1) weights from its own xorshift32 stream.
+struct TBootstrapReplicas {
+    static const size_t Alignment = 4;
+
+    size_t Count = 0;
+    std::vector<uint32_t> States;
+    std::vector<double> Weights;
+    std::vector<double> MeanX;
+    std::vector<double> MeanY;
+    std::vector<double> SumProducts;
+};
+
+enum class ESimdLevel {
+    Scalar,
+    Sse42,
+    Avx2,
+    Avx2Fma,
+    Avx512,
+};
+
+// Batch kernels of one instruction set; the calculators' batch paths go through the table
+// picked for the running CPU, so one binary uses whatever the machine supports.
+struct TSimdKernels {
+    ESimdLevel Level;
+    const char* Name;
+    void (*KahanSums)(const double* xs, const double* ys, size_t count, TKahanSums& sums);
+    void (*WelfordLanes)(const double* xs, const double* ys, size_t count, TWelfordLanes& lanes);
+    void (*WidenFloat)(const float* values, size_t count, double* widened);
+    void (*WidenBFloat16)(const TBFloat16* values, size_t count, double* widened);
+    void (*WidenHalf)(const THalf* values, size_t count, double* widened);
+    void (*PoissonBootstrap)(const double* xs, const double* ys, size_t count, TBootstrapReplicas& replicas);
+};
+
+template <class TInput>
+void WidenScalar(const TInput* values, const size_t count, double* widened) {
+    for (size_t i = 0; i < count; ++i) {
+        widened[i] = (float) values[i];
+    }
+}
+
+// Scalar kernels split every quantity between independent accumulation chains, so
+// consecutive additions do not wait on each other's latency. Quantities are accumulated in
+// separate passes over L1-sized blocks to keep all chains of a pass in registers, and the
+// chains are unrolled by hand: with a runtime chain index GCC keeps them in memory.
+static const size_t ScalarChainsCount = 4;
+static const size_t ScalarBlockSize = 512;
+
+template <class TAccumulator>
+inline void MergeChains(TAccumulator& sum, const TAccumulator* chains) {
+    for (size_t i = 0; i < ScalarChainsCount; ++i) {
+        sum += chains[i];
+    }
+}
+
+inline void MergeChains(TKahanAccumulator& sum, const TKahanAccumulator* chains) {
+    sum.Merge(chains, ScalarChainsCount);
+}
+
+template <class TAccumulator, class TTerm>
+inline void AccumulateChains(TAccumulator& sum, const size_t count, const TTerm& term) {
+    TAccumulator chains[ScalarChainsCount] = {};
+
+    size_t i = 0;
+    for (; i + ScalarChainsCount <= count; i += ScalarChainsCount) {
+        chains[0] += term(i);
+        chains[1] += term(i + 1);
+        chains[2] += term(i + 2);
+        chains[3] += term(i + 3);
+    }
+    for (; i < count; ++i) {
+        chains[0] += term(i);
+    }
+
+    MergeChains(sum, chains);
+}
+
+void KahanSumsScalar(const double* xs, const double* ys, const size_t count, TKahanSums& sums) {
+    TKahanAccumulator sumX;
+    TKahanAccumulator sumY;
+    TKahanAccumulator sumProducts;
+    for (size_t begin = 0; begin < count; begin += ScalarBlockSize) {
+        const double* x = xs + begin;
+        const double* y = ys + begin;
+        const size_t size = std::min(ScalarBlockSize, count - begin);
+        AccumulateChains(sumX, size, [x](const size_t i) { return x[i]; });
+        AccumulateChains(sumY, size, [y](const size_t i) { return y[i]; });
+        AccumulateChains(sumProducts, size, [x, y](const size_t i) { return x[i] * y[i]; });
+    }
+
+    sums.SumX = sumX;
+    sums.SumY = sumY;
+    sums.SumProducts = sumProducts;
+}
+
+inline void WelfordStep(double& meanX, double& meanY, double& sumProducts, const double x, const double y, const double inverse) {
+    meanX += (x - meanX) * inverse;
+    sumProducts += (x - meanX) * (y - meanY);
+    meanY += (y - meanY) * inverse;
+}
+
+void WelfordLanesScalar(const double* xs, const double* ys, const size_t count, TWelfordLanes& lanes) {
+    double meanX[ScalarChainsCount] = {};
+    double meanY[ScalarChainsCount] = {};
+    double sumProducts[ScalarChainsCount] = {};
+
+    size_t n = 0;
+    for (size_t i = 0; i + ScalarChainsCount <= count; i += ScalarChainsCount) {
+        const double inverse = 1. / ++n;
+        WelfordStep(meanX[0], meanY[0], sumProducts[0], xs[i], ys[i], inverse);
+        WelfordStep(meanX[1], meanY[1], sumProducts[1], xs[i + 1], ys[i + 1], inverse);
+        WelfordStep(meanX[2], meanY[2], sumProducts[2], xs[i + 2], ys[i + 2], inverse);
+        WelfordStep(meanX[3], meanY[3], sumProducts[3], xs[i + 3], ys[i + 3], inverse);
+    }
+
+    lanes.Width = ScalarChainsCount;
+    lanes.Count = n;
+    std::copy(meanX, meanX + ScalarChainsCount, lanes.MeanX);
+    std::copy(meanY, meanY + ScalarChainsCount, lanes.MeanY);
+    std::copy(sumProducts, sumProducts + ScalarChainsCount, lanes.SumProducts);
+}
+
+// A 31-bit uniform u maps to the Poisson(1) weight #{j : u > PoissonThresholds[j]}; the tail
+// beyond 10 has probability 1e-8 and is cut off.
+static const size_t PoissonThresholdsCount = 10;
+static const int32_t PoissonThresholds[PoissonThresholdsCount] = {
+    790015083, 1580030168, 1975037710, 2106706891, 2139624186,
+    2146207645, 2147304888, 2147461637, 2147481231, 2147483408,
+};
+
+inline uint64_t MixBits(uint64_t value) {
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+inline uint32_t NextXorShift(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Weighted Welford step; a zero weight leaves the replica unchanged.
+inline void BootstrapStep(double& weight, double& meanX, double& meanY, double& sumProducts, const double x, const double y, const double w) {
+    weight += w;
+    const double ratio = w / std::max(weight, 1.);
+    const double deltaY = y - meanY;
+    meanX += (x - meanX) * ratio;
+    sumProducts += w * (x - meanX) * deltaY;
+    meanY += deltaY * ratio;
+}
+
+void PoissonBootstrapScalar(const double* xs, const double* ys, const size_t count, TBootstrapReplicas& replicas) {
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t replica = 0; replica < replicas.States.size(); ++replica) {
+            const int32_t uniform = NextXorShift(replicas.States[replica]) >> 1;
+            int32_t w = 0;
+            for (const int32_t threshold : PoissonThresholds) {
+                w += uniform > threshold;
+            }
+            BootstrapStep(replicas.Weights[replica], replicas.MeanX[replica], replicas.MeanY[replica],
+                replicas.SumProducts[replica], xs[i], ys[i], w);
+        }
+    }
+}
+
+#ifdef COVARIATION_X86_DISPATCH
+
+// lanes holds width sums followed by width compensations for x, y and products in turn. As in
+// TKahanAccumulator::Merge, all lane sums go in before the compensations.
+void FinishKahanSums(const double* lanes, const size_t width, const double* xs, const double* ys, const size_t count, TKahanSums& sums) {
+    TKahanAccumulator totals[3];
+    for (size_t quantity = 0; quantity < 3; ++quantity) {
+        for (size_t lane = 0; lane < width; ++lane) {
+            totals[quantity] += lanes[2 * quantity * width + lane];
+        }
+        for (size_t lane = 0; lane < width; ++lane) {
+            totals[quantity] += -lanes[(2 * quantity + 1) * width + lane];
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        totals[0] += xs[i];
+        totals[1] += ys[i];
+        totals[2] += xs[i] * ys[i];
+    }
+    sums.SumX = totals[0];
+    sums.SumY = totals[1];
+    sums.SumProducts = totals[2];
+}
+
+__attribute__((target("sse4.2"), always_inline))
+inline void KahanStepSse(__m128d& sum, __m128d& error, const __m128d value) {
+    const __m128d corrected = _mm_sub_pd(value, error);
+    const __m128d next = _mm_add_pd(sum, corrected);
+    error = _mm_sub_pd(_mm_sub_pd(next, sum), corrected);
+    sum = next;
+}
+
+__attribute__((target("sse4.2")))
+void KahanSumsSse42(const double* xs, const double* ys, const size_t count, TKahanSums& sums) {
+    __m128d state[6];
+    for (__m128d& value : state) {
+        value = _mm_setzero_pd();
+    }
+
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const __m128d x = _mm_loadu_pd(xs + i);
+        const __m128d y = _mm_loadu_pd(ys + i);
+        KahanStepSse(state[0], state[1], x);
+        KahanStepSse(state[2], state[3], y);
+        KahanStepSse(state[4], state[5], _mm_mul_pd(x, y));
+    }
+
+    double lanes[6 * 2];
+    for (size_t idx = 0; idx < 6; ++idx) {
+        _mm_storeu_pd(lanes + 2 * idx, state[idx]);
+    }
+    FinishKahanSums(lanes, 2, xs + i, ys + i, count - i, sums);
+}
+
+__attribute__((target("sse4.2")))
+void WelfordLanesSse42(const double* xs, const double* ys, const size_t count, TWelfordLanes& lanes) {
+    __m128d meanX = _mm_setzero_pd();
+    __m128d meanY = _mm_setzero_pd();
+    __m128d sumProducts = _mm_setzero_pd();
+
+    size_t n = 0;
+    for (size_t i = 0; i + 2 <= count; i += 2) {
+        const __m128d inverse = _mm_set1_pd(1. / ++n);
+        const __m128d x = _mm_loadu_pd(xs + i);
+        const __m128d y = _mm_loadu_pd(ys + i);
+        meanX = _mm_add_pd(meanX, _mm_mul_pd(_mm_sub_pd(x, meanX), inverse));
+        sumProducts = _mm_add_pd(sumProducts, _mm_mul_pd(_mm_sub_pd(x, meanX), _mm_sub_pd(y, meanY)));
+        meanY = _mm_add_pd(meanY, _mm_mul_pd(_mm_sub_pd(y, meanY), inverse));
+    }
+
+    lanes.Width = 2;
+    lanes.Count = n;
+    _mm_storeu_pd(lanes.MeanX, meanX);
+    _mm_storeu_pd(lanes.MeanY, meanY);
+    _mm_storeu_pd(lanes.SumProducts, sumProducts);
+}
+
+__attribute__((target("avx2"), always_inline))
+inline void KahanStepAvx2(__m256d& sum, __m256d& error, const __m256d value) {
+    const __m256d corrected = _mm256_sub_pd(value, error);
+    const __m256d next = _mm256_add_pd(sum, corrected);
+    error = _mm256_sub_pd(_mm256_sub_pd(next, sum), corrected);
+    sum = next;
+}
+
+__attribute__((target("avx2")))
+void KahanSumsAvx2(const double* xs, const double* ys, const size_t count, TKahanSums& sums) {
+    __m256d state[6];
+    for (__m256d& value : state) {
+        value = _mm256_setzero_pd();
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256d x = _mm256_loadu_pd(xs + i);
+        const __m256d y = _mm256_loadu_pd(ys + i);
+        KahanStepAvx2(state[0], state[1], x);
+        KahanStepAvx2(state[2], state[3], y);
+        KahanStepAvx2(state[4], state[5], _mm256_mul_pd(x, y));
+    }
+
+    double lanes[6 * 4];
+    for (size_t idx = 0; idx < 6; ++idx) {
+        _mm256_storeu_pd(lanes + 4 * idx, state[idx]);
+    }
+    FinishKahanSums(lanes, 4, xs + i, ys + i, count - i, sums);
+}
+
+__attribute__((target("avx2")))
+void WelfordLanesAvx2(const double* xs, const double* ys, const size_t count, TWelfordLanes& lanes) {
+    __m256d meanX = _mm256_setzero_pd();
+    __m256d meanY = _mm256_setzero_pd();
+    __m256d sumProducts = _mm256_setzero_pd();
+
+    size_t n = 0;
+    for (size_t i = 0; i + 4 <= count; i += 4) {
+        const __m256d inverse = _mm256_set1_pd(1. / ++n);
+        const __m256d x = _mm256_loadu_pd(xs + i);
+        const __m256d y = _mm256_loadu_pd(ys + i);
+        meanX = _mm256_add_pd(meanX, _mm256_mul_pd(_mm256_sub_pd(x, meanX), inverse));
+        sumProducts = _mm256_add_pd(sumProducts, _mm256_mul_pd(_mm256_sub_pd(x, meanX), _mm256_sub_pd(y, meanY)));
+        meanY = _mm256_add_pd(meanY, _mm256_mul_pd(_mm256_sub_pd(y, meanY), inverse));
+    }
+
+    lanes.Width = 4;
+    lanes.Count = n;
+    _mm256_storeu_pd(lanes.MeanX, meanX);
+    _mm256_storeu_pd(lanes.MeanY, meanY);
+    _mm256_storeu_pd(lanes.SumProducts, sumProducts);
+}
+
+__attribute__((target("avx2,fma")))
+void WelfordLanesAvx2Fma(const double* xs, const double* ys, const size_t count, TWelfordLanes& lanes) {
+    __m256d meanX = _mm256_setzero_pd();
+    __m256d meanY = _mm256_setzero_pd();
+    __m256d sumProducts = _mm256_setzero_pd();
+
+    size_t n = 0;
+    for (size_t i = 0; i + 4 <= count; i += 4) {
+        const __m256d inverse = _mm256_set1_pd(1. / ++n);
+        const __m256d x = _mm256_loadu_pd(xs + i);
+        const __m256d y = _mm256_loadu_pd(ys + i);
+        meanX = _mm256_fmadd_pd(_mm256_sub_pd(x, meanX), inverse, meanX);
+        sumProducts = _mm256_fmadd_pd(_mm256_sub_pd(x, meanX), _mm256_sub_pd(y, meanY), sumProducts);
+        meanY = _mm256_fmadd_pd(_mm256_sub_pd(y, meanY), inverse, meanY);
+    }
+
+    lanes.Width = 4;
+    lanes.Count = n;
+    _mm256_storeu_pd(lanes.MeanX, meanX);
+    _mm256_storeu_pd(lanes.MeanY, meanY);
+    _mm256_storeu_pd(lanes.SumProducts, sumProducts);
+}
+
+__attribute__((target("avx512f"), always_inline))
+inline void KahanStepAvx512(__m512d& sum, __m512d& error, const __m512d value) {
+    const __m512d corrected = _mm512_sub_pd(value, error);
+    const __m512d next = _mm512_add_pd(sum, corrected);
+    error = _mm512_sub_pd(_mm512_sub_pd(next, sum), corrected);
+    sum = next;
+}
+
+__attribute__((target("avx512f")))
+void KahanSumsAvx512(const double* xs, const double* ys, const size_t count, TKahanSums& sums) {
+    __m512d state[6];
+    for (__m512d& value : state) {
+        value = _mm512_setzero_pd();
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m512d x = _mm512_loadu_pd(xs + i);
+        const __m512d y = _mm512_loadu_pd(ys + i);
+        KahanStepAvx512(state[0], state[1], x);
+        KahanStepAvx512(state[2], state[3], y);
+        KahanStepAvx512(state[4], state[5], _mm512_mul_pd(x, y));
+    }
+
+    double lanes[6 * 8];
+    for (size_t idx = 0; idx < 6; ++idx) {
+        _mm512_storeu_pd(lanes + 8 * idx, state[idx]);
+    }
+    FinishKahanSums(lanes, 8, xs + i, ys + i, count - i, sums);
+}
+
+__attribute__((target("avx512f")))
+void WelfordLanesAvx512(const double* xs, const double* ys, const size_t count, TWelfordLanes& lanes) {
+    __m512d meanX = _mm512_setzero_pd();
+    __m512d meanY = _mm512_setzero_pd();
+    __m512d sumProducts = _mm512_setzero_pd();
+
+    size_t n = 0;
+    for (size_t i = 0; i + 8 <= count; i += 8) {
+        const __m512d inverse = _mm512_set1_pd(1. / ++n);
+        const __m512d x = _mm512_loadu_pd(xs + i);
+        const __m512d y = _mm512_loadu_pd(ys + i);
+        meanX = _mm512_fmadd_pd(_mm512_sub_pd(x, meanX), inverse, meanX);
+        sumProducts = _mm512_fmadd_pd(_mm512_sub_pd(x, meanX), _mm512_sub_pd(y, meanY), sumProducts);
+        meanY = _mm512_fmadd_pd(_mm512_sub_pd(y, meanY), inverse, meanY);
+    }
+
+    lanes.Width = 8;
+    lanes.Count = n;
+    _mm512_storeu_pd(lanes.MeanX, meanX);
+    _mm512_storeu_pd(lanes.MeanY, meanY);
+    _mm512_storeu_pd(lanes.SumProducts, sumProducts);
+}
+
+// Four replicas per step, in the same operation order as BootstrapStep so every level
+// produces the same replicas.
+__attribute__((target("avx2")))
+void PoissonBootstrapAvx2(const double* xs, const double* ys, const size_t count, TBootstrapReplicas& replicas) {
+    const size_t width = TBootstrapReplicas::Alignment;
+    const __m256d one = _mm256_set1_pd(1.);
+    for (size_t i = 0; i < count; ++i) {
+        const __m256d x = _mm256_set1_pd(xs[i]);
+        const __m256d y = _mm256_set1_pd(ys[i]);
+        for (size_t replica = 0; replica < replicas.States.size(); replica += width) {
+            __m128i state = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&replicas.States[replica]));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&replicas.States[replica]), state);
+
+            const __m128i uniform = _mm_srli_epi32(state, 1);
+            __m128i negated = _mm_setzero_si128();
+            for (const int32_t threshold : PoissonThresholds) {
+                negated = _mm_add_epi32(negated, _mm_cmpgt_epi32(uniform, _mm_set1_epi32(threshold)));
+            }
+            const __m256d w = _mm256_cvtepi32_pd(_mm_sub_epi32(_mm_setzero_si128(), negated));
+
+            const __m256d weight = _mm256_add_pd(_mm256_loadu_pd(&replicas.Weights[replica]), w);
+            const __m256d ratio = _mm256_div_pd(w, _mm256_max_pd(weight, one));
+            __m256d meanX = _mm256_loadu_pd(&replicas.MeanX[replica]);
+            const __m256d meanY = _mm256_loadu_pd(&replicas.MeanY[replica]);
+            const __m256d deltaY = _mm256_sub_pd(y, meanY);
+            meanX = _mm256_add_pd(meanX, _mm256_mul_pd(_mm256_sub_pd(x, meanX), ratio));
+            const __m256d term = _mm256_mul_pd(_mm256_mul_pd(w, _mm256_sub_pd(x, meanX)), deltaY);
+            _mm256_storeu_pd(&replicas.Weights[replica], weight);
+            _mm256_storeu_pd(&replicas.MeanX[replica], meanX);
+            _mm256_storeu_pd(&replicas.SumProducts[replica], _mm256_add_pd(_mm256_loadu_pd(&replicas.SumProducts[replica]), term));
+            _mm256_storeu_pd(&replicas.MeanY[replica], _mm256_add_pd(meanY, _mm256_mul_pd(deltaY, ratio)));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void WidenFloatAvx2(const float* values, const size_t count, double* widened) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(widened + i, _mm256_cvtps_pd(_mm_loadu_ps(values + i)));
+    }
+    WidenScalar(values + i, count - i, widened + i);
+}
+
+__attribute__((target("avx2")))
+void WidenBFloat16Avx2(const TBFloat16* values, const size_t count, double* widened) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+        const __m256 floats = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(bits), 16));
+        _mm256_storeu_pd(widened + i, _mm256_cvtps_pd(_mm256_castps256_ps128(floats)));
+        _mm256_storeu_pd(widened + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(floats, 1)));
+    }
+    WidenScalar(values + i, count - i, widened + i);
+}
+
+__attribute__((target("avx2,f16c")))
+void WidenHalfAvx2(const THalf* values, const size_t count, double* widened) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+        const __m256 floats = _mm256_cvtph_ps(bits);
+        _mm256_storeu_pd(widened + i, _mm256_cvtps_pd(_mm256_castps256_ps128(floats)));
+        _mm256_storeu_pd(widened + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(floats, 1)));
+    }
+    WidenScalar(values + i, count - i, widened + i);
+}
+
+#endif
+
+// Falls back to the best level compiled in when the requested one is not available.
+const TSimdKernels& SimdKernels(const ESimdLevel level) {
+    static const TSimdKernels kernels[] = {
+        {
+            ESimdLevel::Scalar, "scalar", KahanSumsScalar, WelfordLanesScalar,
+            WidenScalar<float>, WidenScalar<TBFloat16>, WidenScalar<THalf>,
+            PoissonBootstrapScalar,
+        },
+#ifdef COVARIATION_X86_DISPATCH
+        {
+            ESimdLevel::Sse42, "sse4.2", KahanSumsSse42, WelfordLanesSse42,
+            WidenScalar<float>, WidenScalar<TBFloat16>, WidenScalar<THalf>,
+            PoissonBootstrapScalar,
+        },
+        {
+            ESimdLevel::Avx2, "avx2", KahanSumsAvx2, WelfordLanesAvx2,
+            WidenFloatAvx2, WidenBFloat16Avx2, WidenHalfAvx2,
+            PoissonBootstrapAvx2,
+        },
+        {
+            ESimdLevel::Avx2Fma, "avx2+fma", KahanSumsAvx2, WelfordLanesAvx2Fma,
+            WidenFloatAvx2, WidenBFloat16Avx2, WidenHalfAvx2,
+            PoissonBootstrapAvx2,
+        },
+        {
+            ESimdLevel::Avx512, "avx512f", KahanSumsAvx512, WelfordLanesAvx512,
+            WidenFloatAvx2, WidenBFloat16Avx2, WidenHalfAvx2,
+            PoissonBootstrapAvx2,
+        },
+#endif
+    };
+    const size_t idx = std::min((size_t) level, sizeof(kernels) / sizeof(kernels[0]) - 1);
+    return kernels[idx];
+}
+
+ESimdLevel DetectSimdLevel() {
+#ifdef COVARIATION_X86_DISPATCH
+    __builtin_cpu_init();
+    const bool f16c = __builtin_cpu_supports("f16c");
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && f16c) {
+        return ESimdLevel::Avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && f16c) {
+        return ESimdLevel::Avx2Fma;
+    }
+    if (__builtin_cpu_supports("avx2") && f16c) {
+        return ESimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ESimdLevel::Sse42;
+    }
+#endif
+    return ESimdLevel::Scalar;
+}
+
+const TSimdKernels& ActiveSimdKernels() {
+    static const TSimdKernels& kernels = SimdKernels(DetectSimdLevel());
+    return kernels;
+}
+
+inline void Widen(const float* values, const size_t count, double* widened) {
+    ActiveSimdKernels().WidenFloat(values, count, widened);
+}
+
+inline void Widen(const TBFloat16* values, const size_t count, double* widened) {
+    ActiveSimdKernels().WidenBFloat16(values, count, widened);
+}
+
+inline void Widen(const THalf* values, const size_t count, double* widened) {
+    ActiveSimdKernels().WidenHalf(values, count, widened);
+}
+
+class ICovariationCalculator {
+private:
+public:
+    virtual void Add(const double x, const double y) = 0;
+    virtual double Covariation() const = 0;
+
+    virtual void AddBatch(const double* xs, const double* ys, const size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            Add(xs[i], ys[i]);
+        }
+    }
+
+    // float, TBFloat16 and THalf inputs are widened block by block into L1-resident buffers
+    // and accumulated in the calculator's own precision, so only the narrow data is read from
+    // memory.
+    template <class TInput>
+    void AddBatch(const TInput* xs, const TInput* ys, const size_t count) {
+        const size_t blockSize = 256;
+        double xBlock[blockSize];
+        double yBlock[blockSize];
+        for (size_t begin = 0; begin < count; begin += blockSize) {
+            const size_t size = std::min(blockSize, count - begin);
+            Widen(xs + begin, size, xBlock);
+            Widen(ys + begin, size, yBlock);
+            AddBatch(xBlock, yBlock, size);
+        }
+    }
+
+    // mask is an LSB-first bitmap as in Arrow; runs of set bits go through AddBatch.
+    void AddMasked(const double* xs, const double* ys, const uint8_t* mask, const size_t count) {
+        size_t runBegin = 0;
+        size_t i = 0;
+        while (i < count) {
+            const uint8_t byte = mask[i / 8];
+            if (i % 8 == 0 && i + 8 <= count && (byte == 0xFF || byte == 0)) {
+                if (!byte) {
+                    AddBatch(xs + runBegin, ys + runBegin, i - runBegin);
+                    runBegin = i + 8;
+                }
+                i += 8;
+                continue;
+            }
+            if (!(byte >> (i % 8) & 1)) {
+                AddBatch(xs + runBegin, ys + runBegin, i - runBegin);
+                runBegin = i + 1;
+            }
+            ++i;
+        }
+        AddBatch(xs + runBegin, ys + runBegin, count - runBegin);
+    }
+
+    virtual std::string Name() const = 0;
+};
+
+template <class TAccumulatorType>
+class TTypedCovariationCalculator : public ICovariationCalculator {
+private:
+    size_t Count = 0;
+    TAccumulatorType SumX = 0.;
+    TAccumulatorType SumY = 0.;
+    TAccumulatorType SumProducts = 0.;
+public:
+    void Add(const double x, const double y) override {
+        ++Count;
+        SumX += x;
+        SumY += y;
+        SumProducts += Product(x, y);
+    }
+
+    using ICovariationCalculator::AddBatch;
+
+    // Raw sums already cancel catastrophically in Covariation() without any retraction, so
+    // unlike Welford there is no stability guard to consult; correctable stores use Welford.
+    void Remove(const double x, const double y) {
+        if (!Count) {
+            throw std::invalid_argument("cannot remove a sample from an empty calculator");
+        }
+        --Count;
+        SumX += -x;
+        SumY += -y;
+        SumProducts += Product(-x, y);
+    }
+
+    void Replace(const double oldX, const double oldY, const double newX, const double newY) {
+        Remove(oldX, oldY);
+        Add(newX, newY);
+    }
+
+    void AddBatch(const double* xs, const double* ys, const size_t count) override {
+        for (size_t begin = 0; begin < count; begin += ScalarBlockSize) {
+            const double* x = xs + begin;
+            const double* y = ys + begin;
+            const size_t size = std::min(ScalarBlockSize, count - begin);
+            AccumulateChains(SumX, size, [x](const size_t i) { return x[i]; });
+            AccumulateChains(SumY, size, [y](const size_t i) { return y[i]; });
+            AccumulateChains(SumProducts, size, [x, y](const size_t i) { return Product(x[i], y[i]); });
+        }
+        Count += count;
+    }
+
+    void Merge(const TTypedCovariationCalculator& other) {
+        Count += other.Count;
+        SumX += other.SumX;
+        SumY += other.SumY;
+        SumProducts += other.SumProducts;
+    }
+
+    double Covariation() const override {
+        return ((double) SumProducts - (double) SumX * (double) SumY / Count) / Count;
+    }
+
+    std::string Name() const override;
+private:
+    static TAccumulatorType Product(const double x, const double y) {
+        return x * y;
+    }
+};
+
+using TDummyCovariationCalculator = TTypedCovariationCalculator<long double>;
+using TKahanCovariationCalculator = TTypedCovariationCalculator<TKahanAccumulator>;
+using TDoubleDoubleCovariationCalculator = TTypedCovariationCalculator<TDoubleDouble>;
+
+template <>
+std::string TDummyCovariationCalculator::Name() const {
+    return "Dummy";
+};
+
+template <>
+std::string TKahanCovariationCalculator::Name() const {
+    return "Kahan";
+};
+
+template <>
+void TKahanCovariationCalculator::AddBatch(const double* xs, const double* ys, const size_t count) {
+    TKahanSums sums;
+    ActiveSimdKernels().KahanSums(xs, ys, count, sums);
+    Count += count;
+    SumX += sums.SumX;
+    SumY += sums.SumY;
+    SumProducts += sums.SumProducts;
+}
+
+// Products are accumulated exactly; rounding them to double first would dominate the error.
+template <>
+TDoubleDouble TDoubleDoubleCovariationCalculator::Product(const double x, const double y) {
+    return TDoubleDouble(x) * TDoubleDouble(y);
+}
+
+template <>
+double TDoubleDoubleCovariationCalculator::Covariation() const {
+    TDoubleDouble centered = SumX * SumY;
+    centered /= (double) Count;
+    return (double) (SumProducts - centered) / Count;
+}
+
+template <>
+std::string TDoubleDoubleCovariationCalculator::Name() const {
+    return "DoubleDouble";
+};
+
+class TWelfordCovariationCalculator : public ICovariationCalculator {
+private:
+    size_t Count = 0;
+    double MeanX = 0.;
+    double MeanY = 0.;
+    double SumProducts = 0.;
+    double RemovedMass = 0.;
+public:
+    TWelfordCovariationCalculator() = default;
+
+    TWelfordCovariationCalculator(const size_t count, const double meanX, const double meanY, const double sumProducts)
+        : Count(count)
+        , MeanX(meanX)
+        , MeanY(meanY)
+        , SumProducts(sumProducts)
+    {
+    }
+
+    void Add(const double x, const double y) override {
+        ++Count;
+        MeanX += (x - MeanX) / Count;
+        SumProducts += (x - MeanX) * (y - MeanY);
+        MeanY += (y - MeanY) / Count;
+    }
+
+    using ICovariationCalculator::AddBatch;
+
+    void AddBatch(const double* xs, const double* ys, const size_t count) override {
+        TWelfordLanes lanes;
+        ActiveSimdKernels().WelfordLanes(xs, ys, count, lanes);
+        for (size_t lane = 0; lane < lanes.Width; ++lane) {
+            Merge(TWelfordCovariationCalculator(lanes.Count, lanes.MeanX[lane], lanes.MeanY[lane], lanes.SumProducts[lane]));
+        }
+        for (size_t i = lanes.Count * lanes.Width; i < count; ++i) {
+            TWelfordCovariationCalculator::Add(xs[i], ys[i]);
+        }
+    }
+
+    // Exact inverse of Add for a sample that was added before.
+    void Remove(const double x, const double y) {
+        if (!Count) {
+            throw std::invalid_argument("cannot remove a sample from an empty calculator");
+        }
+        if (Count == 1) {
+            *this = TWelfordCovariationCalculator();
+            return;
+        }
+
+        --Count;
+        const double deltaY = y - MeanY;
+        MeanY -= deltaY / Count;
+        const double removed = (x - MeanX) * (y - MeanY);
+        SumProducts -= removed;
+        RemovedMass += fabs(removed);
+        MeanX -= (x - MeanX) / Count;
+    }
+
+    void Replace(const double oldX, const double oldY, const double newX, const double newY) {
+        Remove(oldX, oldY);
+        Add(newX, newY);
+    }
+
+    // Each retraction subtracts its term from the co-moment; once the subtracted mass dwarfs
+    // what is left the rounding error of the co-moment exceeds the tolerance. scale floors the
+    // co-moment the error is measured against, for states whose co-moment may be near zero.
+    bool IsStable(const double tolerance = 1e-8, const double scale = 0.) const {
+        return RemovedMass * std::numeric_limits<double>::epsilon() <= tolerance * std::max(fabs(SumProducts), scale);
+    }
+
+    void Merge(const TWelfordCovariationCalculator& other) {
+        if (!Count) {
+            *this = other;
+            return;
+        }
+        if (!other.Count) {
+            return;
+        }
+
+        RemovedMass += other.RemovedMass;
+        const size_t count = Count + other.Count;
+        const double deltaX = other.MeanX - MeanX;
+        const double deltaY = other.MeanY - MeanY;
+        SumProducts += other.SumProducts + deltaX * deltaY * ((double) Count * other.Count / count);
+        MeanX += deltaX * other.Count / count;
+        MeanY += deltaY * other.Count / count;
+        Count = count;
+    }
+
+    double Covariation() const override {
+        return SumProducts / Count;
+    }
+
+    std::string Name() const override {
+        return "Welford";
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+
+    double GetMeanX() const {
+        return MeanX;
+    }
+
+    double GetMeanY() const {
+        return MeanY;
+    }
+
+    double GetSumProducts() const {
+        return SumProducts;
+    }
+};
+
+template <class TValue>
+void WriteValue(std::ostream& out, const TValue& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class TValue>
+TValue ReadValue(std::istream& in) {
+    TValue value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw std::runtime_error("unexpected end of file");
+    }
+    return value;
+}
+
+void WriteWelfordState(std::ostream& out, const TWelfordCovariationCalculator& calculator) {
+    WriteValue<uint64_t>(out, calculator.GetCount());
+    WriteValue<double>(out, calculator.GetMeanX());
+    WriteValue<double>(out, calculator.GetMeanY());
+    WriteValue<double>(out, calculator.GetSumProducts());
+}
+
+TWelfordCovariationCalculator ReadWelfordState(std::istream& in) {
+    const uint64_t count = ReadValue<uint64_t>(in);
+    const double meanX = ReadValue<double>(in);
+    const double meanY = ReadValue<double>(in);
+    const double sumProducts = ReadValue<double>(in);
+    return TWelfordCovariationCalculator(count, meanX, meanY, sumProducts);
+}
+
+// Answers covariance queries over arbitrary [begin, end) ranges of static data in O(1).
+// Global prefix sums are kept per block in double-double relative to the global mean, while
+// positions inside a block keep cheap double prefix sums relative to the block's own mean,
+// so neither level has to subtract two huge nearly equal sums.
+class TPrefixSumCovariationIndex {
+private:
+    struct TSums {
+        size_t Count = 0;
+        TDoubleDouble SumX = 0.;
+        TDoubleDouble SumY = 0.;
+        TDoubleDouble SumProducts = 0.;
+    };
+
+    struct TBlock {
+        double PivotX = 0.;
+        double PivotY = 0.;
+        TSums Preceding;
+    };
+
+    size_t BlockSize;
+    double PivotX = 0.;
+    double PivotY = 0.;
+
+    std::vector<double> PrefixX;
+    std::vector<double> PrefixY;
+    std::vector<double> PrefixProducts;
+    std::vector<TBlock> Blocks;
+public:
+    TPrefixSumCovariationIndex(const std::vector<double>& xs, const std::vector<double>& ys, const size_t blockSize = 1024)
+        : BlockSize(blockSize)
+        , PrefixX(xs.size())
+        , PrefixY(xs.size())
+        , PrefixProducts(xs.size())
+    {
+        if (!xs.empty()) {
+            PivotX = std::accumulate(xs.begin(), xs.end(), 0.) / xs.size();
+            PivotY = std::accumulate(ys.begin(), ys.end(), 0.) / ys.size();
+        }
+
+        const size_t blocksCount = (xs.size() + BlockSize - 1) / BlockSize;
+        Blocks.resize(blocksCount + 1);
+        for (size_t blockIdx = 0; blockIdx < blocksCount; ++blockIdx) {
+            const size_t begin = blockIdx * BlockSize;
+            const size_t end = std::min(begin + BlockSize, xs.size());
+
+            TBlock& block = Blocks[blockIdx];
+            block.PivotX = std::accumulate(xs.begin() + begin, xs.begin() + end, 0.) / (end - begin);
+            block.PivotY = std::accumulate(ys.begin() + begin, ys.begin() + end, 0.) / (end - begin);
+
+            double sumX = 0.;
+            double sumY = 0.;
+            double sumProducts = 0.;
+            for (size_t i = begin; i < end; ++i) {
+                const double dx = xs[i] - block.PivotX;
+                const double dy = ys[i] - block.PivotY;
+                PrefixX[i] = sumX += dx;
+                PrefixY[i] = sumY += dy;
+                PrefixProducts[i] = sumProducts += dx * dy;
+            }
+
+            Blocks[blockIdx + 1].Preceding = Combine(block.Preceding, ToGlobal(blockIdx, begin, end));
+        }
+    }
+
+    double Covariation(const size_t begin, const size_t end) const {
+        if (begin > end || end > Size()) {
+            throw std::out_of_range("prefix sum query range out of bounds");
+        }
+        if (begin == end) {
+            return std::nan("");
+        }
+
+        const size_t firstBlock = begin / BlockSize;
+        const size_t lastBlock = (end - 1) / BlockSize;
+        if (firstBlock == lastBlock) {
+            return Covariation(Local(begin, end));
+        }
+
+        TSums sums = ToGlobal(firstBlock, begin, (firstBlock + 1) * BlockSize);
+        sums = Combine(sums, Subtract(Blocks[lastBlock].Preceding, Blocks[firstBlock + 1].Preceding));
+        sums = Combine(sums, ToGlobal(lastBlock, lastBlock * BlockSize, end));
+        return Covariation(sums);
+    }
+
+    size_t Size() const {
+        return PrefixX.size();
+    }
+private:
+    TSums Local(const size_t begin, const size_t end) const {
+        const bool startsBlock = begin % BlockSize == 0;
+
+        TSums sums;
+        sums.Count = end - begin;
+        sums.SumX = PrefixX[end - 1];
+        sums.SumY = PrefixY[end - 1];
+        sums.SumProducts = PrefixProducts[end - 1];
+        if (!startsBlock) {
+            sums.SumX -= PrefixX[begin - 1];
+            sums.SumY -= PrefixY[begin - 1];
+            sums.SumProducts -= PrefixProducts[begin - 1];
+        }
+        return sums;
+    }
+
+    TSums ToGlobal(const size_t blockIdx, const size_t begin, const size_t end) const {
+        const TSums local = Local(begin, end);
+        const TDoubleDouble shiftX = TDoubleDouble(Blocks[blockIdx].PivotX) - TDoubleDouble(PivotX);
+        const TDoubleDouble shiftY = TDoubleDouble(Blocks[blockIdx].PivotY) - TDoubleDouble(PivotY);
+        const TDoubleDouble count = (double) local.Count;
+
+        TSums sums;
+        sums.Count = local.Count;
+        sums.SumX = local.SumX + count * shiftX;
+        sums.SumY = local.SumY + count * shiftY;
+        sums.SumProducts = local.SumProducts + shiftY * local.SumX + shiftX * local.SumY + count * shiftX * shiftY;
+        return sums;
+    }
+
+    static TSums Combine(const TSums& left, const TSums& right) {
+        TSums sums;
+        sums.Count = left.Count + right.Count;
+        sums.SumX = left.SumX + right.SumX;
+        sums.SumY = left.SumY + right.SumY;
+        sums.SumProducts = left.SumProducts + right.SumProducts;
+        return sums;
+    }
+
+    static TSums Subtract(const TSums& left, const TSums& right) {
+        TSums sums;
+        sums.Count = left.Count - right.Count;
+        sums.SumX = left.SumX - right.SumX;
+        sums.SumY = left.SumY - right.SumY;
+        sums.SumProducts = left.SumProducts - right.SumProducts;
+        return sums;
+    }
+
+    static double Covariation(const TSums& sums) {
+        TDoubleDouble centered = sums.SumX * sums.SumY;
+        centered /= (double) sums.Count;
+        return (double) (sums.SumProducts - centered) / sums.Count;
+    }
+};
+
+// Keeps mergeable calculator states for fixed-size leaf blocks in an implicit binary tree
+// (node i has children 2i and 2i + 1, leaves are stored last), so range queries and point
+// corrections both cost O(log n) merges. Partial leaf blocks at the ends of a range are
+// scanned directly.
+template <class TCalculator = TWelfordCovariationCalculator>
+class TCovariationSegmentTree {
+private:
+    size_t LeafSize;
+    size_t LeavesCount;
+
+    std::vector<double> Xs;
+    std::vector<double> Ys;
+    std::vector<TCalculator> Nodes;
+public:
+    TCovariationSegmentTree(const std::vector<double>& xs, const std::vector<double>& ys, const size_t leafSize = 16)
+        : LeafSize(leafSize)
+        , LeavesCount((xs.size() + leafSize - 1) / leafSize)
+        , Xs(xs)
+        , Ys(ys)
+        , Nodes(2 * LeavesCount)
+    {
+        for (size_t leafIdx = 0; leafIdx < LeavesCount; ++leafIdx) {
+            Nodes[LeavesCount + leafIdx] = Scan(leafIdx * LeafSize, std::min((leafIdx + 1) * LeafSize, Xs.size()));
+        }
+        for (size_t nodeIdx = LeavesCount; nodeIdx-- > 1;) {
+            Nodes[nodeIdx] = Children(nodeIdx);
+        }
+    }
+
+    void Update(const size_t idx, const double x, const double y) {
+        if (idx >= Size()) {
+            throw std::out_of_range("segment tree update index out of bounds");
+        }
+        Xs[idx] = x;
+        Ys[idx] = y;
+
+        const size_t leafIdx = idx / LeafSize;
+        size_t nodeIdx = LeavesCount + leafIdx;
+        Nodes[nodeIdx] = Scan(leafIdx * LeafSize, std::min((leafIdx + 1) * LeafSize, Xs.size()));
+        for (nodeIdx /= 2; nodeIdx > 0; nodeIdx /= 2) {
+            Nodes[nodeIdx] = Children(nodeIdx);
+        }
+    }
+
+    TCalculator Query(const size_t begin, const size_t end) const {
+        if (begin > end || end > Size()) {
+            throw std::out_of_range("segment tree query range out of bounds");
+        }
+        const size_t firstLeaf = (begin + LeafSize - 1) / LeafSize;
+        const size_t lastLeaf = end / LeafSize;
+        if (firstLeaf >= lastLeaf) {
+            return Scan(begin, end);
+        }
+
+        TCalculator result = Scan(begin, firstLeaf * LeafSize);
+        for (size_t left = firstLeaf + LeavesCount, right = lastLeaf + LeavesCount; left < right; left /= 2, right /= 2) {
+            if (left & 1) {
+                result.Merge(Nodes[left++]);
+            }
+            if (right & 1) {
+                result.Merge(Nodes[--right]);
+            }
+        }
+        result.Merge(Scan(lastLeaf * LeafSize, end));
+        return result;
+    }
+
+    double Covariation(const size_t begin, const size_t end) const {
+        return Query(begin, end).Covariation();
+    }
+
+    size_t Size() const {
+        return Xs.size();
+    }
+private:
+    TCalculator Scan(const size_t begin, const size_t end) const {
+        TCalculator calculator;
+        for (size_t i = begin; i < end; ++i) {
+            calculator.Add(Xs[i], Ys[i]);
+        }
+        return calculator;
+    }
+
+    TCalculator Children(const size_t nodeIdx) const {
+        TCalculator calculator = Nodes[2 * nodeIdx];
+        calculator.Merge(Nodes[2 * nodeIdx + 1]);
+        return calculator;
+    }
+};
+
+// Keeps Welford states pre-aggregated per minute, hour and day, so a query over years of
+// history merges a few hundred states instead of rescanning the ticks. Timestamps are in
+// milliseconds; a query covers every minute bucket that starts in [from, to).
+class TCovariationRollupStore {
+private:
+    static const size_t LevelsCount = 3;
+
+    std::map<int64_t, TWelfordCovariationCalculator> Levels[LevelsCount];
+
+    int64_t CurrentStarts[LevelsCount];
+    TWelfordCovariationCalculator* CurrentBuckets[LevelsCount];
+public:
+    TCovariationRollupStore() {
+        ResetCurrentBuckets();
+    }
+
+    TCovariationRollupStore(const TCovariationRollupStore& other)
+        : TCovariationRollupStore()
+    {
+        *this = other;
+    }
+
+    TCovariationRollupStore& operator = (const TCovariationRollupStore& other) {
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            Levels[level] = other.Levels[level];
+        }
+        ResetCurrentBuckets();
+        return *this;
+    }
+
+    void Add(const int64_t timestamp, const double x, const double y) {
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            const int64_t start = FloorTo(timestamp, Resolution(level));
+            if (!CurrentBuckets[level] || CurrentStarts[level] != start) {
+                CurrentStarts[level] = start;
+                CurrentBuckets[level] = &Levels[level][start];
+            }
+            CurrentBuckets[level]->Add(x, y);
+        }
+    }
+
+    TWelfordCovariationCalculator Query(const int64_t from, const int64_t to) const {
+        TWelfordCovariationCalculator result;
+        Collect(0, CeilTo(from, Resolution(0)), CeilTo(to, Resolution(0)), result);
+        return result;
+    }
+
+    double Covariation(const int64_t from, const int64_t to) const {
+        return Query(from, to).Covariation();
+    }
+
+    void Save(const std::string& path) const {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        out.write(Magic, sizeof(Magic));
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            WriteValue<uint64_t>(out, Levels[level].size());
+            for (auto&& bucket : Levels[level]) {
+                WriteValue<int64_t>(out, bucket.first);
+                WriteWelfordState(out, bucket.second);
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("failed to write rollup store " + path);
+        }
+    }
+
+    void Load(const std::string& path) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        char magic[sizeof(Magic)];
+        if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), Magic)) {
+            throw std::runtime_error("not a rollup store: " + path);
+        }
+
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            Levels[level].clear();
+            const uint64_t bucketsCount = ReadValue<uint64_t>(in);
+            for (uint64_t bucketIdx = 0; bucketIdx < bucketsCount; ++bucketIdx) {
+                const int64_t start = ReadValue<int64_t>(in);
+                Levels[level].insert(Levels[level].end(), std::make_pair(start, ReadWelfordState(in)));
+            }
+        }
+        ResetCurrentBuckets();
+    }
+
+    size_t BucketsCount() const {
+        size_t count = 0;
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            count += Levels[level].size();
+        }
+        return count;
+    }
+private:
+    static constexpr char Magic[8] = { 'C', 'O', 'V', 'R', 'O', 'L', 'L', '1' };
+
+    static int64_t Resolution(const size_t level) {
+        static const int64_t resolutions[LevelsCount] = { 60 * 1000, 60 * 60 * 1000, 24 * 60 * 60 * 1000 };
+        return resolutions[level];
+    }
+
+    static int64_t FloorTo(const int64_t timestamp, const int64_t resolution) {
+        const int64_t remainder = timestamp % resolution;
+        return timestamp - (remainder < 0 ? remainder + resolution : remainder);
+    }
+
+    static int64_t CeilTo(const int64_t timestamp, const int64_t resolution) {
+        const int64_t floor = FloorTo(timestamp, resolution);
+        return floor == timestamp ? floor : floor + resolution;
+    }
+
+    void ResetCurrentBuckets() {
+        for (size_t level = 0; level < LevelsCount; ++level) {
+            CurrentStarts[level] = 0;
+            CurrentBuckets[level] = nullptr;
+        }
+    }
+
+    // [from, to) is aligned to the resolution of the level; the part covered by whole coarser
+    // buckets is delegated to the next level.
+    void Collect(const size_t level, const int64_t from, const int64_t to, TWelfordCovariationCalculator& result) const {
+        if (from >= to) {
+            return;
+        }
+
+        if (level + 1 < LevelsCount) {
+            const int64_t coarseFrom = CeilTo(from, Resolution(level + 1));
+            const int64_t coarseTo = FloorTo(to, Resolution(level + 1));
+            if (coarseFrom < coarseTo) {
+                CollectLevel(level, from, coarseFrom, result);
+                Collect(level + 1, coarseFrom, coarseTo, result);
+                CollectLevel(level, coarseTo, to, result);
+                return;
+            }
+        }
+
+        CollectLevel(level, from, to, result);
+    }
+
+    void CollectLevel(const size_t level, const int64_t from, const int64_t to, TWelfordCovariationCalculator& result) const {
+        const auto end = Levels[level].lower_bound(to);
+        for (auto it = Levels[level].lower_bound(from); it != end; ++it) {
+            result.Merge(it->second);
+        }
+    }
+};
+
+constexpr char TCovariationRollupStore::Magic[8];
+
+// Columnar (timestamp, x, y) file made of fixed-size chunks. Every chunk starts with a header
+// carrying the chunk's Welford state and min/max zone maps, and the footer lists the chunk
+// offsets:
+//
+//   magic, chunk size
+//   for each chunk: header, timestamps[count], xs[count], ys[count]
+//   chunk offsets[chunks count], chunks count, footer offset, magic
+struct TColumnarChunkHeader {
+    uint64_t Offset = 0;
+
+    uint64_t RowsCount = 0;
+    int64_t MinTimestamp = std::numeric_limits<int64_t>::max();
+    int64_t MaxTimestamp = std::numeric_limits<int64_t>::min();
+    double MinX = std::numeric_limits<double>::infinity();
+    double MaxX = -std::numeric_limits<double>::infinity();
+    double MinY = std::numeric_limits<double>::infinity();
+    double MaxY = -std::numeric_limits<double>::infinity();
+
+    TWelfordCovariationCalculator State;
+
+    static const size_t SerializedSize = sizeof(uint64_t) + 2 * sizeof(int64_t) + 4 * sizeof(double) + sizeof(uint64_t) + 3 * sizeof(double);
+
+    // Rows with a NaN value never match a query, so they are kept out of the value zone maps
+    // and the state just as a scan of the chunk skips them.
+    void Add(const int64_t timestamp, const double x, const double y) {
+        ++RowsCount;
+        MinTimestamp = std::min(MinTimestamp, timestamp);
+        MaxTimestamp = std::max(MaxTimestamp, timestamp);
+        if (std::isnan(x) || std::isnan(y)) {
+            return;
+        }
+        MinX = std::min(MinX, x);
+        MaxX = std::max(MaxX, x);
+        MinY = std::min(MinY, y);
+        MaxY = std::max(MaxY, y);
+        State.Add(x, y);
+    }
+
+    void Write(std::ostream& out) const {
+        WriteValue<uint64_t>(out, RowsCount);
+        WriteValue<int64_t>(out, MinTimestamp);
+        WriteValue<int64_t>(out, MaxTimestamp);
+        WriteValue<double>(out, MinX);
+        WriteValue<double>(out, MaxX);
+        WriteValue<double>(out, MinY);
+        WriteValue<double>(out, MaxY);
+        WriteWelfordState(out, State);
+    }
+
+    void Read(std::istream& in) {
+        RowsCount = ReadValue<uint64_t>(in);
+        MinTimestamp = ReadValue<int64_t>(in);
+        MaxTimestamp = ReadValue<int64_t>(in);
+        MinX = ReadValue<double>(in);
+        MaxX = ReadValue<double>(in);
+        MinY = ReadValue<double>(in);
+        MaxY = ReadValue<double>(in);
+        State = ReadWelfordState(in);
+    }
+};
+
+static const char ColumnarFileMagic[8] = { 'C', 'O', 'V', 'C', 'O', 'L', 'S', '1' };
+
+class TColumnarFileWriter {
+private:
+    std::ofstream Out;
+    size_t ChunkSize;
+    bool Finished = false;
+
+    std::vector<int64_t> Timestamps;
+    std::vector<double> Xs;
+    std::vector<double> Ys;
+    std::vector<uint64_t> Offsets;
+public:
+    TColumnarFileWriter(const std::string& path, const size_t chunkSize = 1 << 16)
+        : Out(path.c_str(), std::ios::binary)
+        , ChunkSize(chunkSize)
+    {
+        if (!Out) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        Out.write(ColumnarFileMagic, sizeof(ColumnarFileMagic));
+        WriteValue<uint64_t>(Out, ChunkSize);
+    }
+
+    ~TColumnarFileWriter() {
+        if (!Finished) {
+            try {
+                Finish();
+            } catch (...) {
+            }
+        }
+    }
+
+    void Add(const int64_t timestamp, const double x, const double y) {
+        Timestamps.push_back(timestamp);
+        Xs.push_back(x);
+        Ys.push_back(y);
+        if (Timestamps.size() == ChunkSize) {
+            FlushChunk();
+        }
+    }
+
+    void Finish() {
+        FlushChunk();
+
+        const uint64_t footerOffset = Out.tellp();
+        for (const uint64_t offset : Offsets) {
+            WriteValue<uint64_t>(Out, offset);
+        }
+        WriteValue<uint64_t>(Out, Offsets.size());
+        WriteValue<uint64_t>(Out, footerOffset);
+        Out.write(ColumnarFileMagic, sizeof(ColumnarFileMagic));
+        Out.flush();
+        Finished = true;
+
+        if (!Out) {
+            throw std::runtime_error("failed to write columnar file");
+        }
+    }
+private:
+    void FlushChunk() {
+        if (Timestamps.empty()) {
+            return;
+        }
+
+        TColumnarChunkHeader header;
+        for (size_t i = 0; i < Timestamps.size(); ++i) {
+            header.Add(Timestamps[i], Xs[i], Ys[i]);
+        }
+
+        Offsets.push_back(Out.tellp());
+        header.Write(Out);
+        Out.write(reinterpret_cast<const char*>(Timestamps.data()), Timestamps.size() * sizeof(int64_t));
+        Out.write(reinterpret_cast<const char*>(Xs.data()), Xs.size() * sizeof(double));
+        Out.write(reinterpret_cast<const char*>(Ys.data()), Ys.size() * sizeof(double));
+
+        Timestamps.clear();
+        Xs.clear();
+        Ys.clear();
+    }
+};
+
+// Timestamps are filtered by [From, To), values by closed [Min, Max] ranges; rows with a NaN
+// value never match.
+struct TColumnarQuery {
+    int64_t From = std::numeric_limits<int64_t>::min();
+    int64_t To = std::numeric_limits<int64_t>::max();
+    double MinX = -std::numeric_limits<double>::infinity();
+    double MaxX = std::numeric_limits<double>::infinity();
+    double MinY = -std::numeric_limits<double>::infinity();
+    double MaxY = std::numeric_limits<double>::infinity();
+
+    bool Matches(const int64_t timestamp, const double x, const double y) const {
+        return timestamp >= From && timestamp < To && x >= MinX && x <= MaxX && y >= MinY && y <= MaxY;
+    }
+
+    bool Covers(const TColumnarChunkHeader& header) const {
+        return header.MinTimestamp >= From && header.MaxTimestamp < To
+            && header.MinX >= MinX && header.MaxX <= MaxX
+            && header.MinY >= MinY && header.MaxY <= MaxY;
+    }
+
+    bool Excludes(const TColumnarChunkHeader& header) const {
+        return header.MaxTimestamp < From || header.MinTimestamp >= To
+            || header.MaxX < MinX || header.MinX > MaxX
+            || header.MaxY < MinY || header.MinY > MaxY;
+    }
+};
+
+// Answers queries from chunk headers wherever the zone maps allow it and only reads the
+// columns of chunks that straddle the query bounds.
+class TColumnarFileReader {
+private:
+    mutable std::ifstream In;
+    uint64_t ChunkSize = 0;
+    std::vector<TColumnarChunkHeader> Chunks;
+
+    mutable size_t ScannedChunksCount = 0;
+    mutable std::vector<int64_t> Timestamps;
+    mutable std::vector<double> Xs;
+    mutable std::vector<double> Ys;
+public:
+    TColumnarFileReader(const std::string& path)
+        : In(path.c_str(), std::ios::binary)
+    {
+        if (!In) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        CheckMagic(path);
+        ChunkSize = ReadValue<uint64_t>(In);
+        const uint64_t headerSize = In.tellg();
+
+        const std::streamoff trailerSize = 2 * sizeof(uint64_t) + sizeof(ColumnarFileMagic);
+        In.seekg(-trailerSize, std::ios::end);
+        const uint64_t fileSize = (uint64_t) In.tellg() + trailerSize;
+        const uint64_t chunksCount = ReadValue<uint64_t>(In);
+        const uint64_t footerOffset = ReadValue<uint64_t>(In);
+        CheckMagic(path);
+
+        // Every chunk takes at least its header and its footer offset, which bounds the count
+        // before anything is allocated for it.
+        const uint64_t maxChunksCount = (fileSize - headerSize) / (TColumnarChunkHeader::SerializedSize + sizeof(uint64_t));
+        if (chunksCount > maxChunksCount || footerOffset < headerSize || footerOffset + chunksCount * sizeof(uint64_t) + trailerSize > fileSize) {
+            throw std::runtime_error("corrupted columnar footer: " + path);
+        }
+
+        Chunks.resize(chunksCount);
+        In.seekg(footerOffset);
+        for (TColumnarChunkHeader& chunk : Chunks) {
+            chunk.Offset = ReadValue<uint64_t>(In);
+        }
+        for (TColumnarChunkHeader& chunk : Chunks) {
+            In.seekg(chunk.Offset);
+            chunk.Read(In);
+            const uint64_t rowSize = sizeof(int64_t) + 2 * sizeof(double);
+            if (chunk.Offset + TColumnarChunkHeader::SerializedSize > footerOffset
+                || chunk.RowsCount > (footerOffset - chunk.Offset - TColumnarChunkHeader::SerializedSize) / rowSize)
+            {
+                throw std::runtime_error("truncated columnar chunk");
+            }
+        }
+    }
+
+    TWelfordCovariationCalculator Query(const TColumnarQuery& query) const {
+        TWelfordCovariationCalculator result;
+        for (const TColumnarChunkHeader& chunk : Chunks) {
+            if (query.Excludes(chunk)) {
+                continue;
+            }
+            if (query.Covers(chunk)) {
+                result.Merge(chunk.State);
+                continue;
+            }
+
+            ReadChunk(chunk);
+            for (size_t i = 0; i < Timestamps.size(); ++i) {
+                if (query.Matches(Timestamps[i], Xs[i], Ys[i])) {
+                    result.Add(Xs[i], Ys[i]);
+                }
+            }
+        }
+        return result;
+    }
+
+    double Covariation(const TColumnarQuery& query = TColumnarQuery()) const {
+        return Query(query).Covariation();
+    }
+
+    const std::vector<TColumnarChunkHeader>& GetChunks() const {
+        return Chunks;
+    }
+
+    size_t GetScannedChunksCount() const {
+        return ScannedChunksCount;
+    }
+private:
+    void CheckMagic(const std::string& path) {
+        char magic[sizeof(ColumnarFileMagic)];
+        if (!In.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), ColumnarFileMagic)) {
+            throw std::runtime_error("not a columnar covariation file: " + path);
+        }
+    }
+
+    void ReadChunk(const TColumnarChunkHeader& chunk) const {
+        const size_t count = chunk.RowsCount;
+        Timestamps.resize(count);
+        Xs.resize(count);
+        Ys.resize(count);
+
+        In.seekg(chunk.Offset + TColumnarChunkHeader::SerializedSize);
+        In.read(reinterpret_cast<char*>(Timestamps.data()), count * sizeof(int64_t));
+        In.read(reinterpret_cast<char*>(Xs.data()), count * sizeof(double));
+        In.read(reinterpret_cast<char*>(Ys.data()), count * sizeof(double));
+        if (!In) {
+            throw std::runtime_error("truncated columnar chunk");
+        }
+        ++ScannedChunksCount;
+    }
+};
+
+// XOR-delta (Gorilla) compressed stream of doubles. Bits are packed most significant first.
+// Every value after the first is XOR-ed with its predecessor and stored as:
+//   '0'                                               the value repeats
+//   '10' + meaningful bits                            XOR fits the previous leading/trailing window
+//   '11' + 5 bits leading zeros + 6 bits length + meaningful bits
+struct TGorillaStream {
+    size_t Count = 0;
+    std::vector<uint64_t> Words;
+};
+
+class TGorillaEncoder {
+private:
+    TGorillaStream Stream;
+    size_t BitsCount = 0;
+
+    uint64_t Previous = 0;
+    unsigned PreviousLeading = 64;
+    unsigned PreviousTrailing = 0;
+public:
+    void Add(const double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+
+        if (!Stream.Count++) {
+            WriteBits(bits, 64);
+            Previous = bits;
+            return;
+        }
+
+        const uint64_t delta = bits ^ Previous;
+        Previous = bits;
+        if (!delta) {
+            WriteBits(0, 1);
+            return;
+        }
+
+        const unsigned leading = std::min(__builtin_clzll(delta), 31);
+        const unsigned trailing = __builtin_ctzll(delta);
+        if (leading >= PreviousLeading && trailing >= PreviousTrailing) {
+            WriteBits(2, 2);
+            WriteBits(delta >> PreviousTrailing, 64 - PreviousLeading - PreviousTrailing);
+            return;
+        }
+
+        const unsigned meaningful = 64 - leading - trailing;
+        WriteBits(3, 2);
+        WriteBits(leading, 5);
+        WriteBits(meaningful & 63, 6);
+        WriteBits(delta >> trailing, meaningful);
+        PreviousLeading = leading;
+        PreviousTrailing = trailing;
+    }
+
+    const TGorillaStream& GetStream() const {
+        return Stream;
+    }
+private:
+    void WriteBits(uint64_t value, const unsigned count) {
+        if (count < 64) {
+            value &= (1ULL << count) - 1;
+        }
+
+        const unsigned offset = BitsCount % 64;
+        if (!offset) {
+            Stream.Words.push_back(0);
+        }
+
+        const unsigned available = 64 - offset;
+        if (count <= available) {
+            Stream.Words.back() |= count ? value << (available - count) : 0;
+        } else {
+            Stream.Words.back() |= value >> (count - available);
+            Stream.Words.push_back(value << (64 - (count - available)));
+        }
+        BitsCount += count;
+    }
+};
+
+// Decodes into caller-provided blocks; the bit cursor and the XOR window live in locals
+// for the whole block so the hot loop stays in registers.
+class TGorillaDecoder {
+private:
+    const uint64_t* Words;
+    size_t Remaining;
+    size_t Position = 0;
+
+    uint64_t Previous = 0;
+    unsigned Leading = 0;
+    unsigned Meaningful = 0;
+    bool Started = false;
+public:
+    TGorillaDecoder(const TGorillaStream& stream)
+        : Words(stream.Words.data())
+        , Remaining(stream.Count)
+    {
+    }
+
+    size_t Decode(double* values, const size_t maxCount) {
+        const size_t count = std::min(maxCount, Remaining);
+
+        size_t position = Position;
+        uint64_t previous = Previous;
+        unsigned leading = Leading;
+        unsigned meaningful = Meaningful;
+
+        size_t i = 0;
+        if (count && !Started) {
+            previous = ReadBits(position, 64);
+            memcpy(&values[i++], &previous, sizeof(previous));
+            Started = true;
+        }
+        for (; i < count; ++i) {
+            if (ReadBits(position, 1)) {
+                if (ReadBits(position, 1)) {
+                    leading = ReadBits(position, 5);
+                    meaningful = ReadBits(position, 6);
+                    if (!meaningful) {
+                        meaningful = 64;
+                    }
+                }
+                previous ^= ReadBits(position, meaningful) << (64 - leading - meaningful);
+            }
+            memcpy(&values[i], &previous, sizeof(previous));
+        }
+
+        Position = position;
+        Previous = previous;
+        Leading = leading;
+        Meaningful = meaningful;
+        Remaining -= count;
+        return count;
+    }
+private:
+    uint64_t ReadBits(size_t& position, const unsigned count) const {
+        const size_t wordIdx = position / 64;
+        const unsigned offset = position % 64;
+        position += count;
+
+        const uint64_t word = Words[wordIdx] << offset;
+        if (offset + count <= 64) {
+            return word >> (64 - count);
+        }
+        return (word >> (64 - count)) | (Words[wordIdx + 1] >> (128 - offset - count));
+    }
+};
+
+// Decodes both streams block by block into L1-sized buffers and feeds them to the batch path
+// of the calculator, so the decoded series is never materialized.
+void AddGorilla(const TGorillaStream& xs, const TGorillaStream& ys, ICovariationCalculator& calculator) {
+    if (xs.Count != ys.Count) {
+        throw std::invalid_argument("gorilla streams have different lengths");
+    }
+
+    const size_t blockSize = 256;
+    double xBlock[blockSize];
+    double yBlock[blockSize];
+
+    TGorillaDecoder xDecoder(xs);
+    TGorillaDecoder yDecoder(ys);
+    while (const size_t count = xDecoder.Decode(xBlock, blockSize)) {
+        yDecoder.Decode(yBlock, count);
+        calculator.AddBatch(xBlock, yBlock, count);
+    }
+}
+
+class TMappedFile {
+private:
+    const uint8_t* Data = nullptr;
+    size_t Size = 0;
+public:
+    TMappedFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open " + path);
+        }
+
+        struct stat status;
+        if (fstat(fd, &status) == 0) {
+            Size = status.st_size;
+        }
+        void* data = Size ? mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("failed to map " + path);
+        }
+        Data = static_cast<const uint8_t*>(data);
+    }
+
+    ~TMappedFile() {
+        munmap(const_cast<uint8_t*>(Data), Size);
+    }
+
+    TMappedFile(const TMappedFile&) = delete;
+    TMappedFile& operator = (const TMappedFile&) = delete;
+
+    const uint8_t* GetData() const {
+        return Data;
+    }
+
+    size_t GetSize() const {
+        return Size;
+    }
+};
+
+// Read-only view of a flatbuffers table, just enough to walk Arrow IPC metadata. Every offset
+// is checked against the [Begin, End) buffer the table lives in before it is followed, so
+// corrupted metadata throws instead of reading outside the file.
+class TFlatTable {
+private:
+    const uint8_t* Begin = nullptr;
+    const uint8_t* End = nullptr;
+    const uint8_t* Data = nullptr;
+    const uint8_t* VTable = nullptr;
+    uint16_t VTableSize = 0;
+public:
+    TFlatTable() = default;
+
+    TFlatTable(const uint8_t* begin, const uint8_t* end, const uint8_t* table)
+        : Begin(begin)
+        , End(end)
+        , Data(table)
+    {
+        CheckRange(Begin, End, Data, sizeof(int32_t));
+        const int64_t vtablePosition = (Data - Begin) - (int64_t) Load<int32_t>(Data);
+        if (vtablePosition < 0 || vtablePosition > End - Begin) {
+            throw std::runtime_error("flatbuffer vtable out of bounds");
+        }
+        VTable = Begin + vtablePosition;
+        CheckRange(Begin, End, VTable, 2 * sizeof(uint16_t));
+        VTableSize = Load<uint16_t>(VTable);
+        CheckRange(Begin, End, VTable, VTableSize);
+    }
+
+    static TFlatTable Root(const uint8_t* begin, const uint8_t* end) {
+        CheckRange(begin, end, begin, sizeof(uint32_t));
+        return TFlatTable(begin, end, Follow(begin, end, begin));
+    }
+
+    explicit operator bool() const {
+        return Data;
+    }
+
+    bool Has(const size_t fieldId) const {
+        return Field(fieldId, 0);
+    }
+
+    template <class TValue>
+    TValue Scalar(const size_t fieldId, const TValue defaultValue = TValue()) const {
+        const uint8_t* field = Field(fieldId, sizeof(TValue));
+        return field ? Load<TValue>(field) : defaultValue;
+    }
+
+    TFlatTable Table(const size_t fieldId) const {
+        const uint8_t* field = Field(fieldId, sizeof(uint32_t));
+        return field ? TFlatTable(Begin, End, Follow(Begin, End, field)) : TFlatTable();
+    }
+
+    // Returns the first element of a vector field of elementSize-byte elements and stores its
+    // length.
+    const uint8_t* Vector(const size_t fieldId, const size_t elementSize, uint32_t& length) const {
+        const uint8_t* field = Field(fieldId, sizeof(uint32_t));
+        if (!field) {
+            length = 0;
+            return nullptr;
+        }
+        const uint8_t* vector = Follow(Begin, End, field);
+        length = Load<uint32_t>(vector);
+        CheckRange(Begin, End, vector + sizeof(uint32_t), (uint64_t) length * elementSize);
+        return vector + sizeof(uint32_t);
+    }
+
+    TFlatTable VectorTable(const size_t fieldId, const size_t idx) const {
+        uint32_t length;
+        const uint8_t* elements = Vector(fieldId, sizeof(uint32_t), length);
+        if (idx >= length) {
+            throw std::runtime_error("flatbuffer vector index out of range");
+        }
+        return TFlatTable(Begin, End, Follow(Begin, End, elements + idx * sizeof(uint32_t)));
+    }
+
+    std::string String(const size_t fieldId) const {
+        uint32_t length;
+        const uint8_t* chars = Vector(fieldId, 1, length);
+        return chars ? std::string(reinterpret_cast<const char*>(chars), length) : std::string();
+    }
+
+    template <class TValue>
+    static TValue Load(const uint8_t* data) {
+        TValue value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+private:
+    const uint8_t* Field(const size_t fieldId, const size_t size) const {
+        const size_t entry = sizeof(uint16_t) * (2 + fieldId);
+        if (entry + sizeof(uint16_t) > VTableSize) {
+            return nullptr;
+        }
+        const uint16_t offset = Load<uint16_t>(VTable + entry);
+        if (!offset) {
+            return nullptr;
+        }
+        CheckRange(Begin, End, Data, (uint64_t) offset + size);
+        return Data + offset;
+    }
+
+    // The target has to hold at least the 4-byte prefix every table, vector and string starts
+    // with.
+    static const uint8_t* Follow(const uint8_t* begin, const uint8_t* end, const uint8_t* field) {
+        const uint32_t offset = Load<uint32_t>(field);
+        CheckRange(begin, end, field, (uint64_t) offset + sizeof(uint32_t));
+        return field + offset;
+    }
+
+    static void CheckRange(const uint8_t* begin, const uint8_t* end, const uint8_t* position, const uint64_t size) {
+        if (position < begin || position > end || size > (uint64_t) (end - position)) {
+            throw std::runtime_error("flatbuffer offset out of bounds");
+        }
+    }
+};
+
+// Reads uncompressed Arrow IPC files (the random access "ARROW1" format) through mmap and
+// feeds float64 columns of every record batch to a calculator without copying them; rows
+// that are null or NaN in either column are skipped through a selection bitmap. Blocks, field
+// nodes and buffers are checked against the file and the record batch body before use.
+// Columns of types without a known layout only make themselves and the columns after them
+// unreadable, and only when they are requested.
+class TArrowFileReader {
+private:
+    struct TColumn {
+        std::string Name;
+        uint8_t Type = 0;
+        int16_t Precision = 0;
+        bool Dictionary = false;
+        bool Located = false;
+        size_t FirstNode = 0;
+        size_t FirstBuffer = 0;
+        size_t FirstView = 0;
+    };
+
+    struct TBlock {
+        int64_t Offset;
+        int32_t MetaDataLength;
+        int64_t BodyLength;
+    };
+
+    enum EArrowType : uint8_t {
+        AT_NULL = 1,
+        AT_INT = 2,
+        AT_FLOATING_POINT = 3,
+        AT_BINARY = 4,
+        AT_UTF8 = 5,
+        AT_BOOL = 6,
+        AT_DECIMAL = 7,
+        AT_DATE = 8,
+        AT_TIME = 9,
+        AT_TIMESTAMP = 10,
+        AT_INTERVAL = 11,
+        AT_LIST = 12,
+        AT_STRUCT = 13,
+        AT_UNION = 14,
+        AT_FIXED_SIZE_BINARY = 15,
+        AT_FIXED_SIZE_LIST = 16,
+        AT_MAP = 17,
+        AT_DURATION = 18,
+        AT_LARGE_BINARY = 19,
+        AT_LARGE_UTF8 = 20,
+        AT_LARGE_LIST = 21,
+        AT_RUN_END_ENCODED = 22,
+        AT_BINARY_VIEW = 23,
+        AT_UTF8_VIEW = 24,
+        AT_LIST_VIEW = 25,
+        AT_LARGE_LIST_VIEW = 26,
+    };
+
+    static const int16_t DenseUnionMode = 1;
+
+    static const uint8_t RecordBatchHeader = 3;
+    static const int16_t DoublePrecision = 2;
+    static const size_t MaxNestingDepth = 64;
+
+    TMappedFile File;
+    std::vector<TColumn> Columns;
+    std::vector<TBlock> RecordBatches;
+public:
+    TArrowFileReader(const std::string& path)
+        : File(path)
+    {
+        static const char magic[] = "ARROW1";
+        const size_t magicSize = 6;
+        const uint8_t* data = File.GetData();
+        const size_t size = File.GetSize();
+        if (size < 2 * magicSize + 2 + sizeof(int32_t)
+            || memcmp(data, magic, magicSize)
+            || memcmp(data + size - magicSize, magic, magicSize))
+        {
+            throw std::runtime_error("not an arrow file: " + path);
+        }
+
+        const int32_t footerLength = TFlatTable::Load<int32_t>(data + size - magicSize - sizeof(int32_t));
+        if (footerLength <= 0 || (size_t) footerLength > size - 2 * magicSize - 2 - sizeof(int32_t)) {
+            throw std::runtime_error("corrupted arrow footer: " + path);
+        }
+        const uint8_t* footerEnd = data + size - magicSize - sizeof(int32_t);
+        const TFlatTable footer = TFlatTable::Root(footerEnd - footerLength, footerEnd);
+
+        const TFlatTable schema = footer.Table(1);
+        uint32_t fieldsCount;
+        schema.Vector(1, sizeof(uint32_t), fieldsCount);
+        size_t nodesCount = 0;
+        size_t buffersCount = 0;
+        size_t viewsCount = 0;
+        bool located = true;
+        for (uint32_t fieldIdx = 0; fieldIdx < fieldsCount; ++fieldIdx) {
+            const TFlatTable field = schema.VectorTable(1, fieldIdx);
+
+            TColumn column;
+            column.Name = field.String(0);
+            column.Type = field.Scalar<uint8_t>(2);
+            column.Dictionary = field.Has(4);
+            if (column.Type == AT_FLOATING_POINT) {
+                column.Precision = field.Table(3).Scalar<int16_t>(0);
+            }
+            column.FirstNode = nodesCount;
+            column.FirstBuffer = buffersCount;
+            column.FirstView = viewsCount;
+            located = located && CountLayout(field, 0, nodesCount, buffersCount, viewsCount);
+            column.Located = located;
+            Columns.push_back(column);
+        }
+
+        uint32_t batchesCount;
+        const size_t blockSize = 24;
+        const uint8_t* blocks = footer.Vector(3, blockSize, batchesCount);
+        for (uint32_t batchIdx = 0; batchIdx < batchesCount; ++batchIdx) {
+            const uint8_t* block = blocks + batchIdx * blockSize;
+            const TBlock recordBatch = {
+                TFlatTable::Load<int64_t>(block),
+                TFlatTable::Load<int32_t>(block + 8),
+                TFlatTable::Load<int64_t>(block + 16),
+            };
+            if (recordBatch.Offset < 0 || recordBatch.MetaDataLength < 2 * (int32_t) sizeof(int32_t) || recordBatch.BodyLength < 0
+                || (uint64_t) recordBatch.Offset > size
+                || (uint64_t) recordBatch.MetaDataLength > size - recordBatch.Offset
+                || (uint64_t) recordBatch.BodyLength > size - recordBatch.Offset - recordBatch.MetaDataLength)
+            {
+                throw std::runtime_error("arrow record batch block out of bounds: " + path);
+            }
+            RecordBatches.push_back(recordBatch);
+        }
+    }
+
+    size_t FindColumn(const std::string& name) const {
+        for (size_t columnIdx = 0; columnIdx < Columns.size(); ++columnIdx) {
+            if (Columns[columnIdx].Name == name) {
+                return columnIdx;
+            }
+        }
+        throw std::invalid_argument("no column " + name);
+    }
+
+    void AddColumns(const std::string& xName, const std::string& yName, ICovariationCalculator& calculator) const {
+        const TColumn& x = DoubleColumn(xName);
+        const TColumn& y = DoubleColumn(yName);
+
+        std::vector<uint8_t> mask;
+        for (const TBlock& block : RecordBatches) {
+            const TFlatTable batch = RecordBatch(block);
+            const int64_t length = batch.Scalar<int64_t>(0);
+            if (length < 0 || length > block.BodyLength) {
+                throw std::runtime_error("arrow record batch length exceeds its body");
+            }
+
+            const size_t xBuffer = FirstBuffer(batch, x);
+            const size_t yBuffer = FirstBuffer(batch, y);
+            const double* xs = Values(batch, block, xBuffer, length);
+            const double* ys = Values(batch, block, yBuffer, length);
+            const uint8_t* xValidity = Validity(batch, block, x, xBuffer, length);
+            const uint8_t* yValidity = Validity(batch, block, y, yBuffer, length);
+            const bool hasNan = HasNan(xs, length) || HasNan(ys, length);
+
+            if (!xValidity && !yValidity && !hasNan) {
+                calculator.AddBatch(xs, ys, length);
+                continue;
+            }
+            mask.assign((length + 7) / 8, 0xFF);
+            for (const uint8_t* validity : { xValidity, yValidity }) {
+                for (size_t i = 0; validity && i < mask.size(); ++i) {
+                    mask[i] &= validity[i];
+                }
+            }
+            for (int64_t i = 0; hasNan && i < length; ++i) {
+                if (std::isnan(xs[i]) || std::isnan(ys[i])) {
+                    mask[i / 8] &= ~(1 << (i % 8));
+                }
+            }
+            calculator.AddMasked(xs, ys, mask.data(), length);
+        }
+    }
+
+    size_t RecordBatchesCount() const {
+        return RecordBatches.size();
+    }
+private:
+    // Children are followed through forward offsets only, but a corrupted schema may still
+    // share them between parents; the node count is bounded by the file size, since every
+    // node has a 16-byte entry in each record batch. View types also own a per-batch number of
+    // variadic buffers, which are counted in viewsCount. Returns false for a type whose layout
+    // is unknown, leaving the counters meaningless from then on.
+    bool CountLayout(const TFlatTable& field, const size_t depth, size_t& nodesCount, size_t& buffersCount, size_t& viewsCount) const {
+        if (depth > MaxNestingDepth || ++nodesCount > File.GetSize()) {
+            throw std::runtime_error("arrow schema is too deeply nested");
+        }
+        if (field.Has(4)) {
+            buffersCount += 2;
+            return true;
+        }
+
+        switch (field.Scalar<uint8_t>(2)) {
+            case AT_NULL:
+                break;
+            case AT_INT:
+            case AT_FLOATING_POINT:
+            case AT_BOOL:
+            case AT_DECIMAL:
+            case AT_DATE:
+            case AT_TIME:
+            case AT_TIMESTAMP:
+            case AT_INTERVAL:
+            case AT_FIXED_SIZE_BINARY:
+            case AT_DURATION:
+                buffersCount += 2;
+                break;
+            case AT_BINARY:
+            case AT_UTF8:
+            case AT_LARGE_BINARY:
+            case AT_LARGE_UTF8:
+                buffersCount += 3;
+                break;
+            case AT_STRUCT:
+            case AT_FIXED_SIZE_LIST:
+                buffersCount += 1;
+                break;
+            case AT_LIST:
+            case AT_MAP:
+            case AT_LARGE_LIST:
+                buffersCount += 2;
+                break;
+            case AT_LIST_VIEW:
+            case AT_LARGE_LIST_VIEW:
+                buffersCount += 3;
+                break;
+            case AT_BINARY_VIEW:
+            case AT_UTF8_VIEW:
+                buffersCount += 2;
+                ++viewsCount;
+                break;
+            case AT_UNION:
+                buffersCount += field.Table(3).Scalar<int16_t>(0) == DenseUnionMode ? 2 : 1;
+                break;
+            case AT_RUN_END_ENCODED:
+                break;
+            default:
+                return false;
+        }
+
+        uint32_t childrenCount;
+        field.Vector(5, sizeof(uint32_t), childrenCount);
+        for (uint32_t childIdx = 0; childIdx < childrenCount; ++childIdx) {
+            if (!CountLayout(field.VectorTable(5, childIdx), depth + 1, nodesCount, buffersCount, viewsCount)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool HasNan(const double* values, const int64_t count) {
+        return std::any_of(values, values + count, [](const double value) { return std::isnan(value); });
+    }
+
+    const TColumn& DoubleColumn(const std::string& name) const {
+        const TColumn& column = Columns[FindColumn(name)];
+        if (!column.Located) {
+            throw std::runtime_error("unsupported arrow type at or before column " + name);
+        }
+        if (column.Type != AT_FLOATING_POINT || column.Precision != DoublePrecision || column.Dictionary) {
+            throw std::invalid_argument("column " + name + " is not float64");
+        }
+        return column;
+    }
+
+    TFlatTable RecordBatch(const TBlock& block) const {
+        const uint8_t* metadata = File.GetData() + block.Offset;
+        const uint8_t* end = metadata + block.MetaDataLength;
+        if (TFlatTable::Load<uint32_t>(metadata) == 0xFFFFFFFF) {
+            metadata += sizeof(uint32_t);
+        }
+        if (end - metadata < (int64_t) (2 * sizeof(int32_t))) {
+            throw std::runtime_error("arrow record batch metadata is truncated");
+        }
+        const TFlatTable message = TFlatTable::Root(metadata + sizeof(int32_t), end);
+        if (message.Scalar<uint8_t>(1) != RecordBatchHeader) {
+            throw std::runtime_error("arrow block is not a record batch");
+        }
+
+        const TFlatTable batch = message.Table(2);
+        if (batch.Has(3)) {
+            throw std::runtime_error("compressed arrow record batches are not supported");
+        }
+        return batch;
+    }
+
+    // Returns nullptr for an empty buffer.
+    const uint8_t* Buffer(const TFlatTable& batch, const TBlock& block, const size_t bufferIdx, const uint64_t minSize) const {
+        uint32_t buffersCount;
+        const uint8_t* buffers = batch.Vector(2, 16, buffersCount);
+        if (bufferIdx >= buffersCount) {
+            throw std::runtime_error("arrow record batch has too few buffers");
+        }
+
+        const uint8_t* buffer = buffers + bufferIdx * 16;
+        const int64_t offset = TFlatTable::Load<int64_t>(buffer);
+        const int64_t length = TFlatTable::Load<int64_t>(buffer + 8);
+        if (offset < 0 || length < 0 || offset > block.BodyLength || length > block.BodyLength - offset || (uint64_t) length < minSize) {
+            throw std::runtime_error("arrow buffer out of bounds");
+        }
+        return length ? File.GetData() + block.Offset + block.MetaDataLength + offset : nullptr;
+    }
+
+    // Adds the variadic buffers of the view columns preceding the column in this batch; a batch
+    // without the counts has none.
+    size_t FirstBuffer(const TFlatTable& batch, const TColumn& column) const {
+        uint32_t countsCount;
+        const uint8_t* counts = batch.Vector(4, sizeof(int64_t), countsCount);
+        if (!counts) {
+            return column.FirstBuffer;
+        }
+        if (column.FirstView > countsCount) {
+            throw std::runtime_error("arrow record batch has too few variadic buffer counts");
+        }
+        size_t bufferIdx = column.FirstBuffer;
+        for (size_t viewIdx = 0; viewIdx < column.FirstView; ++viewIdx) {
+            const int64_t count = TFlatTable::Load<int64_t>(counts + viewIdx * sizeof(int64_t));
+            if (count < 0 || (uint64_t) count > File.GetSize()) {
+                throw std::runtime_error("arrow variadic buffer count out of bounds");
+            }
+            bufferIdx += count;
+        }
+        return bufferIdx;
+    }
+
+    const double* Values(const TFlatTable& batch, const TBlock& block, const size_t firstBuffer, const int64_t length) const {
+        const uint8_t* values = Buffer(batch, block, firstBuffer + 1, length * sizeof(double));
+        if (reinterpret_cast<uintptr_t>(values) % alignof(double)) {
+            throw std::runtime_error("misaligned arrow buffer");
+        }
+        return reinterpret_cast<const double*>(values);
+    }
+
+    const uint8_t* Validity(const TFlatTable& batch, const TBlock& block, const TColumn& column, const size_t firstBuffer, const int64_t length) const {
+        uint32_t nodesCount;
+        const uint8_t* nodes = batch.Vector(1, 16, nodesCount);
+        if (column.FirstNode >= nodesCount) {
+            throw std::runtime_error("arrow record batch has too few field nodes");
+        }
+        const int64_t nullCount = TFlatTable::Load<int64_t>(nodes + column.FirstNode * 16 + 8);
+        return nullCount ? Buffer(batch, block, firstBuffer, (length + 7) / 8) : nullptr;
+    }
+};
+
+struct TColumnBatch {
+    const int64_t* Timestamps = nullptr;
+    const int64_t* Keys = nullptr;
+    const double* Xs = nullptr;
+    const double* Ys = nullptr;
+    size_t Size = 0;
+};
+
+// Conjunction of simple predicates evaluated column at a time into an LSB-first selection
+// bitmap, eight rows per byte without branches, so the selected rows reach the calculator
+// through AddMasked instead of being copied out first. Timestamps are filtered by [from, to),
+// values by closed [min, max] ranges.
+class TBatchFilter {
+private:
+    static const size_t LinearSearchKeysCount = 16;
+
+    bool FilterX = false;
+    double MinX = 0.;
+    double MaxX = 0.;
+
+    bool FilterY = false;
+    double MinY = 0.;
+    double MaxY = 0.;
+
+    bool FilterTimestamps = false;
+    int64_t From = 0;
+    int64_t To = 0;
+
+    bool FilterKeys = false;
+    std::vector<int64_t> Keys;
+
+    mutable std::vector<uint8_t> Mask;
+public:
+    TBatchFilter& WithXRange(const double minX, const double maxX) {
+        FilterX = true;
+        MinX = minX;
+        MaxX = maxX;
+        return *this;
+    }
+
+    TBatchFilter& WithYRange(const double minY, const double maxY) {
+        FilterY = true;
+        MinY = minY;
+        MaxY = maxY;
+        return *this;
+    }
+
+    TBatchFilter& WithTimestamps(const int64_t from, const int64_t to) {
+        FilterTimestamps = true;
+        From = from;
+        To = to;
+        return *this;
+    }
+
+    TBatchFilter& WithKeys(std::vector<int64_t> keys) {
+        FilterKeys = true;
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        Keys.swap(keys);
+        return *this;
+    }
+
+    void Evaluate(const TColumnBatch& batch, std::vector<uint8_t>& mask) const {
+        mask.assign((batch.Size + 7) / 8, 0xFF);
+        if (batch.Size % 8) {
+            mask.back() = (1 << (batch.Size % 8)) - 1;
+        }
+
+        if (FilterX) {
+            Select(mask, batch.Size, [&](const size_t i) { return batch.Xs[i] >= MinX && batch.Xs[i] <= MaxX; });
+        }
+        if (FilterY) {
+            Select(mask, batch.Size, [&](const size_t i) { return batch.Ys[i] >= MinY && batch.Ys[i] <= MaxY; });
+        }
+        if (FilterTimestamps) {
+            Require(batch, batch.Timestamps, "timestamps");
+            Select(mask, batch.Size, [&](const size_t i) { return batch.Timestamps[i] >= From && batch.Timestamps[i] < To; });
+        }
+        if (FilterKeys && Keys.size() <= LinearSearchKeysCount) {
+            Require(batch, batch.Keys, "keys");
+            Select(mask, batch.Size, [&](const size_t i) {
+                bool found = false;
+                for (const int64_t key : Keys) {
+                    found |= batch.Keys[i] == key;
+                }
+                return found;
+            });
+        } else if (FilterKeys) {
+            Require(batch, batch.Keys, "keys");
+            Select(mask, batch.Size, [&](const size_t i) { return std::binary_search(Keys.begin(), Keys.end(), batch.Keys[i]); });
+        }
+    }
+
+    void Apply(const TColumnBatch& batch, ICovariationCalculator& calculator) const {
+        Evaluate(batch, Mask);
+        calculator.AddMasked(batch.Xs, batch.Ys, Mask.data(), batch.Size);
+    }
+private:
+    template <class TPredicate>
+    static void Select(std::vector<uint8_t>& mask, const size_t size, TPredicate&& predicate) {
+        const size_t fullBytes = size / 8;
+        for (size_t byteIdx = 0; byteIdx < fullBytes; ++byteIdx) {
+            if (!mask[byteIdx]) {
+                continue;
+            }
+            uint8_t bits = 0;
+            for (size_t bitIdx = 0; bitIdx < 8; ++bitIdx) {
+                bits |= (uint8_t) predicate(byteIdx * 8 + bitIdx) << bitIdx;
+            }
+            mask[byteIdx] &= bits;
+        }
+        for (size_t i = fullBytes * 8; i < size; ++i) {
+            if (!predicate(i)) {
+                mask[i / 8] &= ~(1 << (i % 8));
+            }
+        }
+    }
+
+    static void Require(const TColumnBatch& batch, const int64_t* column, const char* name) {
+        if (!column && batch.Size) {
+            throw std::invalid_argument(std::string("filter needs the ") + name + " column");
+        }
+    }
+};
+
+struct TKeyedValue {
+    int64_t Date;
+    int64_t Id;
+    double Value;
+};
+
+// Reads whitespace separated "date id value" lines one row at a time. Blank lines are skipped;
+// any other line that is not exactly one row throws with its line number, so a header or a
+// typo cannot silently cut the series short.
+class TKeyedSeriesReader {
+private:
+    std::string Path;
+    std::ifstream In;
+    size_t LineNumber = 0;
+    std::string Line;
+    std::istringstream LineStream;
+public:
+    TKeyedSeriesReader(const std::string& path)
+        : Path(path)
+        , In(path.c_str())
+    {
+        if (!In) {
+            throw std::runtime_error("failed to open " + path);
+        }
+    }
+
+    bool Next(TKeyedValue& row) {
+        while (std::getline(In, Line)) {
+            ++LineNumber;
+            if (Line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            LineStream.clear();
+            LineStream.str(Line);
+            if (!(LineStream >> row.Date >> row.Id >> row.Value) || !(LineStream >> std::ws).eof()) {
+                throw std::runtime_error("malformed row at " + Path + ":" + std::to_string(LineNumber));
+            }
+            return true;
+        }
+        if (In.bad()) {
+            throw std::runtime_error("failed to read " + Path);
+        }
+        return false;
+    }
+};
+
+// Joins two keyed series on (date, id) and aggregates every matching pair straight into a
+// calculator. The build side is radix partitioned by the high hash bits into open addressing
+// tables sized for L2; probe rows are buffered per partition and probed a partition batch at a
+// time, so the probe side can be streamed and the join result is never materialized.
+class TKeyedHashJoin {
+private:
+    struct TSlot {
+        uint64_t Hash = 0;
+        TKeyedValue Row;
+    };
+
+    struct TPartition {
+        std::vector<TSlot> Slots;
+        std::vector<TKeyedValue> Pending;
+    };
+
+    static const size_t PartitionRowsCount = 1 << 14;
+    static const size_t PendingRowsCount = 256;
+
+    ICovariationCalculator& Calculator;
+    bool BuildIsX;
+    size_t PartitionBits = 0;
+    std::vector<TPartition> Partitions;
+public:
+    TKeyedHashJoin(const std::vector<TKeyedValue>& build, const bool buildIsX, ICovariationCalculator& calculator)
+        : Calculator(calculator)
+        , BuildIsX(buildIsX)
+    {
+        while ((build.size() >> PartitionBits) > PartitionRowsCount) {
+            ++PartitionBits;
+        }
+        Partitions.resize(1 << PartitionBits);
+
+        std::vector<size_t> counts(Partitions.size(), 0);
+        for (const TKeyedValue& row : build) {
+            ++counts[PartitionOf(Hash(row))];
+        }
+        for (size_t partitionIdx = 0; partitionIdx < Partitions.size(); ++partitionIdx) {
+            size_t capacity = 1;
+            while (capacity < 2 * counts[partitionIdx]) {
+                capacity *= 2;
+            }
+            Partitions[partitionIdx].Slots.resize(capacity);
+        }
+
+        for (const TKeyedValue& row : build) {
+            const uint64_t hash = Hash(row);
+            std::vector<TSlot>& slots = Partitions[PartitionOf(hash)].Slots;
+            size_t slotIdx = hash & (slots.size() - 1);
+            while (slots[slotIdx].Hash) {
+                slotIdx = (slotIdx + 1) & (slots.size() - 1);
+            }
+            slots[slotIdx].Hash = hash;
+            slots[slotIdx].Row = row;
+        }
+    }
+
+    void Probe(const TKeyedValue& row) {
+        TPartition& partition = Partitions[PartitionOf(Hash(row))];
+        partition.Pending.push_back(row);
+        if (partition.Pending.size() == PendingRowsCount) {
+            ProbePending(partition);
+        }
+    }
+
+    void Finish() {
+        for (TPartition& partition : Partitions) {
+            ProbePending(partition);
+        }
+    }
+private:
+    static uint64_t Hash(const TKeyedValue& row) {
+        uint64_t hash = (uint64_t) row.Date * 0x9E3779B97F4A7C15ULL ^ (uint64_t) row.Id;
+        hash ^= hash >> 30;
+        hash *= 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94D049BB133111EBULL;
+        hash ^= hash >> 31;
+        return hash | 1;
+    }
+
+    size_t PartitionOf(const uint64_t hash) const {
+        return PartitionBits ? hash >> (64 - PartitionBits) : 0;
+    }
+
+    void ProbePending(TPartition& partition) {
+        const std::vector<TSlot>& slots = partition.Slots;
+        if (slots.empty()) {
+            partition.Pending.clear();
+            return;
+        }
+
+        for (const TKeyedValue& row : partition.Pending) {
+            const uint64_t hash = Hash(row);
+            for (size_t slotIdx = hash & (slots.size() - 1); slots[slotIdx].Hash; slotIdx = (slotIdx + 1) & (slots.size() - 1)) {
+                const TKeyedValue& match = slots[slotIdx].Row;
+                if (slots[slotIdx].Hash != hash || match.Date != row.Date || match.Id != row.Id) {
+                    continue;
+                }
+                if (BuildIsX) {
+                    Calculator.Add(match.Value, row.Value);
+                } else {
+                    Calculator.Add(row.Value, match.Value);
+                }
+            }
+        }
+        partition.Pending.clear();
+    }
+};
+
+// Loads the smaller file (by size on disk) into the join and streams the larger one through it.
+void JoinKeyedSeries(const std::string& xPath, const std::string& yPath, ICovariationCalculator& calculator) {
+    struct stat xStatus;
+    struct stat yStatus;
+    if (stat(xPath.c_str(), &xStatus) || stat(yPath.c_str(), &yStatus)) {
+        throw std::runtime_error("failed to stat " + xPath + " or " + yPath);
+    }
+
+    const bool buildIsX = xStatus.st_size <= yStatus.st_size;
+    TKeyedSeriesReader buildReader(buildIsX ? xPath : yPath);
+    std::vector<TKeyedValue> build;
+    TKeyedValue row;
+    while (buildReader.Next(row)) {
+        build.push_back(row);
+    }
+
+    TKeyedHashJoin join(build, buildIsX, calculator);
+    std::vector<TKeyedValue>().swap(build);
+
+    TKeyedSeriesReader probeReader(buildIsX ? yPath : xPath);
+    while (probeReader.Next(row)) {
+        join.Probe(row);
+    }
+    join.Finish();
+}
+
+// Identifies a dataset by its file and the file's modification time and size, so rewriting
+// the file invalidates everything cached for it.
+struct TDatasetId {
+    std::string Path;
+    int64_t ModificationTime = 0;
+    int64_t Size = 0;
+
+    static TDatasetId FromFile(const std::string& path) {
+        struct stat status;
+        if (stat(path.c_str(), &status)) {
+            throw std::runtime_error("failed to stat " + path);
+        }
+
+        TDatasetId id;
+        id.Path = path;
+        id.ModificationTime = (int64_t) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+        id.Size = status.st_size;
+        return id;
+    }
+};
+
+// LRU cache of calculator states keyed by (dataset, calculator, row range). Besides the exact
+// query ranges it keeps the states of aligned blocks, so a query that overlaps earlier ones
+// reuses their blocks and only scans what is new.
+template <class TCalculator = TWelfordCovariationCalculator>
+class TCovariationResultCache {
+public:
+    using TScanner = std::function<TCalculator(size_t begin, size_t end)>;
+private:
+    using TKey = std::tuple<std::string, int64_t, int64_t, std::string, size_t, size_t>;
+
+    struct TEntry {
+        TKey Key;
+        TCalculator State;
+        size_t Bytes;
+    };
+
+    // The index points at the keys stored in the list, so every key string is held once.
+    struct TKeyLess {
+        bool operator () (const TKey* left, const TKey* right) const {
+            return *left < *right;
+        }
+    };
+
+    size_t MaxBytes;
+    size_t BlockSize;
+    size_t Bytes = 0;
+    size_t QueryHits = 0;
+    size_t QueryMisses = 0;
+    size_t BlockHits = 0;
+    size_t BlockMisses = 0;
+
+    std::list<TEntry> Entries;
+    std::map<const TKey*, typename std::list<TEntry>::iterator, TKeyLess> Index;
+public:
+    TCovariationResultCache(const size_t maxBytes, const size_t blockSize = 1 << 16)
+        : MaxBytes(maxBytes)
+        , BlockSize(blockSize)
+    {
+    }
+
+    TCalculator Query(const TDatasetId& dataset, const size_t begin, const size_t end, const TScanner& scan) {
+        const TKey key = Key(dataset, begin, end);
+        TCalculator result;
+        if (Find(key, result)) {
+            ++QueryHits;
+            return result;
+        }
+        ++QueryMisses;
+
+        const size_t firstBlock = (begin + BlockSize - 1) / BlockSize;
+        const size_t lastBlock = end / BlockSize;
+        if (firstBlock >= lastBlock) {
+            result = scan(begin, end);
+        } else {
+            result = scan(begin, firstBlock * BlockSize);
+            for (size_t blockIdx = firstBlock; blockIdx < lastBlock; ++blockIdx) {
+                const size_t blockBegin = blockIdx * BlockSize;
+                const TKey blockKey = Key(dataset, blockBegin, blockBegin + BlockSize);
+                TCalculator block;
+                if (Find(blockKey, block)) {
+                    ++BlockHits;
+                } else {
+                    ++BlockMisses;
+                    block = scan(blockBegin, blockBegin + BlockSize);
+                    Insert(blockKey, block);
+                }
+                result.Merge(block);
+            }
+            result.Merge(scan(lastBlock * BlockSize, end));
+        }
+
+        Insert(key, result);
+        return result;
+    }
+
+    // Whole queries answered from the cache, and those that were not.
+    size_t GetQueryHits() const {
+        return QueryHits;
+    }
+
+    size_t GetQueryMisses() const {
+        return QueryMisses;
+    }
+
+    // Aligned blocks of missed queries that were reused, and those that had to be scanned.
+    size_t GetBlockHits() const {
+        return BlockHits;
+    }
+
+    size_t GetBlockMisses() const {
+        return BlockMisses;
+    }
+
+    size_t GetBytes() const {
+        return Bytes;
+    }
+private:
+    static TKey Key(const TDatasetId& dataset, const size_t begin, const size_t end) {
+        return TKey(dataset.Path, dataset.ModificationTime, dataset.Size, TCalculator().Name(), begin, end);
+    }
+
+    bool Find(const TKey& key, TCalculator& state) {
+        const auto it = Index.find(&key);
+        if (it == Index.end()) {
+            return false;
+        }
+
+        Entries.splice(Entries.begin(), Entries, it->second);
+        state = it->second->State;
+        return true;
+    }
+
+    void Insert(const TKey& key, const TCalculator& state) {
+        if (Index.count(&key)) {
+            return;
+        }
+
+        // The entry with its key strings, a list node's two links and a map node's three
+        // links, colour, key pointer and iterator.
+        const size_t bytes = sizeof(TEntry) + std::get<0>(key).size() + std::get<3>(key).size() + 8 * sizeof(void*);
+        if (bytes > MaxBytes) {
+            return;
+        }
+
+        Entries.push_front(TEntry{key, state, bytes});
+        Index[&Entries.front().Key] = Entries.begin();
+        Bytes += bytes;
+
+        while (Bytes > MaxBytes) {
+            Bytes -= Entries.back().Bytes;
+            Index.erase(&Entries.back().Key);
+            Entries.pop_back();
+        }
+    }
+};
+
+// Keeps raw samples in fixed-size chunks next to per-chunk and total Welford states, so a
+// vendor correction is applied to both states by retraction in O(1). When a state's guard
+// reports too much cancellation only the affected chunk is rescanned, and the total is
+// re-merged from the chunk states instead of rescanning everything. The total's guard measures
+// the retracted mass against the sum of the chunks' absolute co-moments as well, since chunk
+// co-moments of opposite signs, or of uncorrelated series, leave a total near zero.
+class TCorrectableCovariationStore {
+private:
+    size_t ChunkSize;
+    double Tolerance;
+
+    std::vector<double> Xs;
+    std::vector<double> Ys;
+    std::vector<uint8_t> Present;
+    std::vector<TWelfordCovariationCalculator> Chunks;
+    TWelfordCovariationCalculator Total;
+    double TotalScale = 0.;
+
+    size_t RescannedChunksCount = 0;
+    size_t RemergedTotalsCount = 0;
+public:
+    TCorrectableCovariationStore(const size_t chunkSize = 1 << 16, const double tolerance = 1e-8)
+        : ChunkSize(chunkSize)
+        , Tolerance(tolerance)
+    {
+    }
+
+    void Add(const double x, const double y) {
+        if (Xs.size() % ChunkSize == 0) {
+            Chunks.push_back(TWelfordCovariationCalculator());
+        }
+        Xs.push_back(x);
+        Ys.push_back(y);
+        Present.push_back(1);
+        Chunks.back().Add(x, y);
+        Total.Add(x, y);
+    }
+
+    void Replace(const size_t idx, const double x, const double y) {
+        CheckIndex(idx);
+        TWelfordCovariationCalculator& chunk = Chunks[idx / ChunkSize];
+        if (Present[idx]) {
+            chunk.Replace(Xs[idx], Ys[idx], x, y);
+            Total.Replace(Xs[idx], Ys[idx], x, y);
+        } else {
+            chunk.Add(x, y);
+            Total.Add(x, y);
+        }
+        Xs[idx] = x;
+        Ys[idx] = y;
+        Present[idx] = 1;
+        Stabilize(idx / ChunkSize);
+    }
+
+    void Remove(const size_t idx) {
+        CheckIndex(idx);
+        if (!Present[idx]) {
+            return;
+        }
+        Chunks[idx / ChunkSize].Remove(Xs[idx], Ys[idx]);
+        Total.Remove(Xs[idx], Ys[idx]);
+        Present[idx] = 0;
+        Stabilize(idx / ChunkSize);
+    }
+
+    double Covariation() const {
+        return Total.Covariation();
+    }
+
+    const TWelfordCovariationCalculator& GetTotal() const {
+        return Total;
+    }
+
+    size_t GetRescannedChunksCount() const {
+        return RescannedChunksCount;
+    }
+
+    size_t GetRemergedTotalsCount() const {
+        return RemergedTotalsCount;
+    }
+private:
+    void CheckIndex(const size_t idx) const {
+        if (idx >= Xs.size()) {
+            throw std::out_of_range("correction index out of bounds");
+        }
+    }
+
+    void Stabilize(const size_t chunkIdx) {
+        TWelfordCovariationCalculator& chunk = Chunks[chunkIdx];
+        if (!chunk.IsStable(Tolerance)) {
+            chunk = TWelfordCovariationCalculator();
+            const size_t end = std::min((chunkIdx + 1) * ChunkSize, Xs.size());
+            for (size_t i = chunkIdx * ChunkSize; i < end; ++i) {
+                if (Present[i]) {
+                    chunk.Add(Xs[i], Ys[i]);
+                }
+            }
+            ++RescannedChunksCount;
+        }
+
+        if (!Total.IsStable(Tolerance, TotalScale)) {
+            TWelfordCovariationCalculator merged;
+            TotalScale = 0.;
+            for (const TWelfordCovariationCalculator& state : Chunks) {
+                merged.Merge(state);
+                TotalScale += fabs(state.GetSumProducts());
+            }
+            // The chunks are stable, so the re-merged total starts without retracted mass.
+            Total = TWelfordCovariationCalculator(merged.GetCount(), merged.GetMeanX(), merged.GetMeanY(), merged.GetSumProducts());
+            ++RemergedTotalsCount;
+        }
+    }
+};
+
+// Runs replicasCount Poisson bootstrap replicas next to the estimate itself: every sample
+// enters each replica with an independent Poisson(1) weight, which approximates resampling
+// with replacement without a second pass over the data.
+class TPoissonBootstrapCovariationCalculator : public ICovariationCalculator {
+private:
+    TWelfordCovariationCalculator Estimate;
+    TBootstrapReplicas Replicas;
+public:
+    explicit TPoissonBootstrapCovariationCalculator(const size_t replicasCount = 200, const uint32_t seed = 1) {
+        if (!replicasCount) {
+            throw std::invalid_argument("bootstrap needs at least one replica");
+        }
+
+        const size_t alignment = TBootstrapReplicas::Alignment;
+        const size_t paddedCount = (replicasCount + alignment - 1) / alignment * alignment;
+        Replicas.Count = replicasCount;
+        Replicas.States.resize(paddedCount);
+        Replicas.Weights.assign(paddedCount, 0.);
+        Replicas.MeanX.assign(paddedCount, 0.);
+        Replicas.MeanY.assign(paddedCount, 0.);
+        Replicas.SumProducts.assign(paddedCount, 0.);
+
+        // Streams stepped from one shared state would be shifted copies of each other, so every
+        // replica hashes (seed, replica) into a state of its own; xorshift needs it non-zero.
+        for (size_t replica = 0; replica < paddedCount; ++replica) {
+            const uint32_t state = MixBits((uint64_t) seed << 32 | replica) >> 32;
+            Replicas.States[replica] = state ? state : 1;
+        }
+    }
+
+    void Add(const double x, const double y) override {
+        Estimate.Add(x, y);
+        ActiveSimdKernels().PoissonBootstrap(&x, &y, 1, Replicas);
+    }
+
+    using ICovariationCalculator::AddBatch;
+
+    void AddBatch(const double* xs, const double* ys, const size_t count) override {
+        Estimate.AddBatch(xs, ys, count);
+        ActiveSimdKernels().PoissonBootstrap(xs, ys, count, Replicas);
+    }
+
+    double Covariation() const override {
+        return Estimate.Covariation();
+    }
+
+    std::string Name() const override {
+        return "PoissonBootstrap";
+    }
+
+    size_t GetReplicasCount() const {
+        return Replicas.Count;
+    }
+
+    double ReplicaWeight(const size_t replica) const {
+        return Replicas.Weights[replica];
+    }
+
+    double ReplicaCovariation(const size_t replica) const {
+        const double weight = Replicas.Weights[replica];
+        return weight > 0. ? Replicas.SumProducts[replica] / weight : 0.;
+    }
+
+    double StandardError() const {
+        TKahanAccumulator sum;
+        TKahanAccumulator sumSquares;
+        for (size_t replica = 0; replica < Replicas.Count; ++replica) {
+            const double covariation = ReplicaCovariation(replica);
+            sum += covariation;
+            sumSquares += covariation * covariation;
+        }
+        const double mean = (double) sum / Replicas.Count;
+        return sqrt(std::max((double) sumSquares / Replicas.Count - mean * mean, 0.));
+    }
+
+    // Percentile interval of the replicas covering the central level of their distribution.
+    std::pair<double, double> ConfidenceInterval(const double level = 0.95) const {
+        if (!(level > 0. && level < 1.)) {
+            throw std::invalid_argument("confidence level must lie in (0, 1)");
+        }
+
+        std::vector<double> covariations(Replicas.Count);
+        for (size_t replica = 0; replica < Replicas.Count; ++replica) {
+            covariations[replica] = ReplicaCovariation(replica);
+        }
+        const double tail = (1. - level) / 2. * (Replicas.Count - 1);
+        const size_t lower = (size_t) floor(tail);
+        const size_t upper = Replicas.Count - 1 - lower;
+        std::nth_element(covariations.begin(), covariations.begin() + lower, covariations.end());
+        const double lowerValue = covariations[lower];
+        std::nth_element(covariations.begin(), covariations.begin() + upper, covariations.end());
+        return std::make_pair(lowerValue, covariations[upper]);
+    }
+};
+
+// Delete-one-block jackknife: samples are grouped into blocks of blockSize, or into groups
+// ended explicitly with CloseBlock() when blockSize is 0, and every block keeps a mergeable
+// state. A query combines prefix and suffix merges, so the leave-one-block-out estimates
+// cost O(blocks) without another pass over the data.
+class TJackknifeCovariationCalculator : public ICovariationCalculator {
+private:
+    size_t BlockSize;
+    std::vector<TWelfordCovariationCalculator> Blocks;
+    TWelfordCovariationCalculator Current;
+public:
+    explicit TJackknifeCovariationCalculator(const size_t blockSize = 1 << 12)
+        : BlockSize(blockSize)
+    {
+    }
+
+    void Add(const double x, const double y) override {
+        Current.Add(x, y);
+        if (BlockSize && Current.GetCount() == BlockSize) {
+            CloseBlock();
+        }
+    }
+
+    using ICovariationCalculator::AddBatch;
+
+    void AddBatch(const double* xs, const double* ys, const size_t count) override {
+        size_t i = 0;
+        while (i < count) {
+            const size_t size = BlockSize ? std::min(BlockSize - Current.GetCount(), count - i) : count - i;
+            Current.AddBatch(xs + i, ys + i, size);
+            i += size;
+            if (BlockSize && Current.GetCount() == BlockSize) {
+                CloseBlock();
+            }
+        }
+    }
+
+    void CloseBlock() {
+        if (Current.GetCount()) {
+            Blocks.push_back(Current);
+            Current = TWelfordCovariationCalculator();
+        }
+    }
+
+    double Covariation() const override {
+        TWelfordCovariationCalculator total = Current;
+        for (const TWelfordCovariationCalculator& block : Blocks) {
+            total.Merge(block);
+        }
+        return total.Covariation();
+    }
+
+    std::string Name() const override {
+        return "Jackknife";
+    }
+
+    size_t BlocksCount() const {
+        return Blocks.size() + (Current.GetCount() ? 1 : 0);
+    }
+
+    // Covariation with each block left out in turn; the open block counts as the last one.
+    std::vector<double> LeaveOneOutCovariations() const {
+        std::vector<TWelfordCovariationCalculator> blocks(Blocks);
+        if (Current.GetCount()) {
+            blocks.push_back(Current);
+        }
+
+        const size_t count = blocks.size();
+        std::vector<TWelfordCovariationCalculator> suffixes(count + 1);
+        for (size_t i = count; i-- > 0;) {
+            suffixes[i] = blocks[i];
+            suffixes[i].Merge(suffixes[i + 1]);
+        }
+
+        std::vector<double> covariations(count);
+        TWelfordCovariationCalculator prefix;
+        for (size_t i = 0; i < count; ++i) {
+            TWelfordCovariationCalculator rest = prefix;
+            rest.Merge(suffixes[i + 1]);
+            covariations[i] = rest.Covariation();
+            prefix.Merge(blocks[i]);
+        }
+        return covariations;
+    }
+
+    // (g - 1) / g * sum (theta_i - theta_mean)^2 over the g leave-one-out estimates.
+    double Variance() const {
+        const std::vector<double> covariations = LeaveOneOutCovariations();
+        const size_t count = covariations.size();
+        if (count < 2) {
+            throw std::runtime_error("jackknife needs at least two blocks");
+        }
+
+        const double mean = std::accumulate(covariations.begin(), covariations.end(), 0.) / count;
+        double sumSquares = 0.;
+        for (const double covariation : covariations) {
+            sumSquares += (covariation - mean) * (covariation - mean);
+        }
+        return sumSquares * (count - 1) / count;
+    }
+
+    double StandardError() const {
+        return sqrt(Variance());
+    }
+
+    // Bias-corrected estimate g * theta - (g - 1) * theta_mean.
+    double BiasCorrectedCovariation() const {
+        const std::vector<double> covariations = LeaveOneOutCovariations();
+        const size_t count = covariations.size();
+        const double mean = std::accumulate(covariations.begin(), covariations.end(), 0.) / count;
+        return count * Covariation() - (count - 1.) * mean;
+    }
+};
+
+// Ranks starting at 1, tied values share the mean of their ranks.
+std::vector<double> AverageRanks(const double* values, const size_t count) {
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [values](const size_t left, const size_t right) {
+        return values[left] < values[right];
+    });
+
+    std::vector<double> ranks(count);
+    for (size_t begin = 0; begin < count;) {
+        size_t end = begin + 1;
+        while (end < count && values[order[end]] == values[order[begin]]) {
+            ++end;
+        }
+        const double rank = (begin + end + 1) / 2.;
+        for (size_t i = begin; i < end; ++i) {
+            ranks[order[i]] = rank;
+        }
+        begin = end;
+    }
+    return ranks;
+}
+
+// Pearson correlation of the average ranks.
+double SpearmanRho(const double* xs, const double* ys, const size_t count) {
+    const std::vector<double> xRanks = AverageRanks(xs, count);
+    const std::vector<double> yRanks = AverageRanks(ys, count);
+
+    // Average ranks always have mean (count + 1) / 2.
+    const double mean = (count + 1) / 2.;
+    double sumProducts = 0.;
+    double sumSquaresX = 0.;
+    double sumSquaresY = 0.;
+    for (size_t i = 0; i < count; ++i) {
+        sumProducts += (xRanks[i] - mean) * (yRanks[i] - mean);
+        sumSquaresX += (xRanks[i] - mean) * (xRanks[i] - mean);
+        sumSquaresY += (yRanks[i] - mean) * (yRanks[i] - mean);
+    }
+    return sumProducts / sqrt(sumSquaresX * sumSquaresY);
+}
+
+// Pairs of equal neighbours among count sorted items; equal compares two item indices.
+template <class TEqual>
+uint64_t TiedPairsCount(const size_t count, const TEqual& equal) {
+    uint64_t tied = 0;
+    uint64_t run = 1;
+    for (size_t i = 1; i <= count; ++i) {
+        if (i < count && equal(i - 1, i)) {
+            ++run;
+        } else {
+            tied += run * (run - 1) / 2;
+            run = 1;
+        }
+    }
+    return tied;
+}
+
+// Kendall's tau-b in O(n log n) by Knight's algorithm: sort by (x, y), then count the swaps
+// a merge sort by y needs; every swap is a discordant pair.
+double KendallTau(const double* xs, const double* ys, const size_t count) {
+    std::vector<std::pair<double, double>> points(count);
+    for (size_t i = 0; i < count; ++i) {
+        points[i] = std::make_pair(xs[i], ys[i]);
+    }
+    std::sort(points.begin(), points.end());
+
+    const uint64_t pairsCount = (uint64_t) count * (count - 1) / 2;
+    const uint64_t tiedX = TiedPairsCount(count, [&points](const size_t left, const size_t right) {
+        return points[left].first == points[right].first;
+    });
+    const uint64_t tiedXY = TiedPairsCount(count, [&points](const size_t left, const size_t right) {
+        return points[left] == points[right];
+    });
+
+    std::vector<double> values(count);
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = points[i].second;
+    }
+    std::vector<double> buffer(count);
+    uint64_t swaps = 0;
+    for (size_t width = 1; width < count; width *= 2) {
+        for (size_t begin = 0; begin < count; begin += 2 * width) {
+            const size_t middle = std::min(begin + width, count);
+            const size_t end = std::min(begin + 2 * width, count);
+            size_t left = begin;
+            size_t right = middle;
+            size_t out = begin;
+            while (left < middle && right < end) {
+                if (values[right] < values[left]) {
+                    swaps += middle - left;
+                    buffer[out++] = values[right++];
+                } else {
+                    buffer[out++] = values[left++];
+                }
+            }
+            out = std::copy(values.begin() + left, values.begin() + middle, buffer.begin() + out) - buffer.begin();
+            std::copy(values.begin() + right, values.begin() + end, buffer.begin() + out);
+        }
+        values.swap(buffer);
+    }
+
+    const uint64_t tiedY = TiedPairsCount(count, [&values](const size_t left, const size_t right) {
+        return values[left] == values[right];
+    });
+    const double numerator = (double) pairsCount - tiedX - tiedY + tiedXY - 2. * swaps;
+    return numerator / sqrt((double) (pairsCount - tiedX) * (pairsCount - tiedY));
+}
+
+// Streaming Kendall's tau-b in O(log^2 n) amortized per sample. New samples collect in a
+// buffer that is scanned directly; a full buffer becomes a static run, and runs of equal
+// size are merged like a binary counter, so there are O(log n) runs and every sample is
+// rebuilt O(log n) times. A run keeps its points ordered by x and a wavelet matrix of their
+// y ranks, which counts the points of an x prefix below a y rank in O(log n), so a new
+// sample learns how many partners of a run lie in each quadrant around it with four such
+// counts. Memory is three doubles plus about 2 log n bits per sample.
+class TKendallTauCalculator {
+private:
+    // rank1 over a bit vector; every word is stored next to the popcount of the words before
+    // it, so a rank costs one cache miss.
+    struct TBitVector {
+        struct TWord {
+            uint64_t Bits = 0;
+            uint64_t Rank = 0;
+        };
+
+        std::vector<TWord> Words;
+        size_t Zeros = 0;
+
+        size_t Rank1(const size_t position) const {
+            const TWord& word = Words[position / 64];
+            const size_t bit = position % 64;
+            return word.Rank + (bit ? __builtin_popcountll(word.Bits << (64 - bit)) : 0);
+        }
+    };
+
+    struct TRun {
+        std::vector<double> Xs;
+        std::vector<double> Ys;
+        std::vector<double> SortedYs;
+        std::vector<TBitVector> Levels;
+
+        size_t Size() const {
+            return Xs.size();
+        }
+
+        // Points among the first prefix ones (by x) whose y rank is below rank.
+        size_t RankLess(const size_t prefix, const size_t rank) const {
+            if (rank >> Levels.size()) {
+                return prefix;
+            }
+
+            size_t begin = 0;
+            size_t end = prefix;
+            size_t count = 0;
+            for (size_t level = 0; level < Levels.size(); ++level) {
+                const TBitVector& bits = Levels[level];
+                const size_t beginOnes = bits.Rank1(begin);
+                const size_t endOnes = bits.Rank1(end);
+                if (rank >> (Levels.size() - 1 - level) & 1) {
+                    count += (end - begin) - (endOnes - beginOnes);
+                    begin = bits.Zeros + beginOnes;
+                    end = bits.Zeros + endOnes;
+                } else {
+                    begin -= beginOnes;
+                    end -= endOnes;
+                }
+            }
+            return count;
+        }
+    };
+
+    size_t BufferSize;
+    std::vector<std::pair<double, double>> Buffer;
+    std::vector<TRun> Runs;
+    uint64_t Count = 0;
+    int64_t ConcordanceBalance = 0;
+    uint64_t TiedX = 0;
+    uint64_t TiedY = 0;
+public:
+    explicit TKendallTauCalculator(const size_t bufferSize = 64)
+        : BufferSize(std::max<size_t>(bufferSize, 1))
+    {
+    }
+
+    void Add(const double x, const double y) {
+        for (const std::pair<double, double>& point : Buffer) {
+            const int signX = (x > point.first) - (x < point.first);
+            const int signY = (y > point.second) - (y < point.second);
+            ConcordanceBalance += signX * signY;
+            TiedX += !signX;
+            TiedY += !signY;
+        }
+        for (const TRun& run : Runs) {
+            if (run.Size()) {
+                AddPartners(run, x, y);
+            }
+        }
+        ++Count;
+
+        Buffer.push_back(std::make_pair(x, y));
+        if (Buffer.size() == BufferSize) {
+            Flush();
+        }
+    }
+
+    void AddBatch(const double* xs, const double* ys, const size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            Add(xs[i], ys[i]);
+        }
+    }
+
+    double Tau() const {
+        const uint64_t pairsCount = Count * (Count - 1) / 2;
+        return ConcordanceBalance / sqrt((double) (pairsCount - TiedX) * (pairsCount - TiedY));
+    }
+
+    uint64_t GetCount() const {
+        return Count;
+    }
+private:
+    // Adds concordant minus discordant partners of (x, y) in the run to the balance; ties on
+    // either axis count as neither and are added to the tie counts instead.
+    void AddPartners(const TRun& run, const double x, const double y) {
+        const int64_t size = run.Size();
+        const int64_t xBelow = std::lower_bound(run.Xs.begin(), run.Xs.end(), x) - run.Xs.begin();
+        const int64_t xUpTo = std::upper_bound(run.Xs.begin() + xBelow, run.Xs.end(), x) - run.Xs.begin();
+        const int64_t yBelow = std::lower_bound(run.SortedYs.begin(), run.SortedYs.end(), y) - run.SortedYs.begin();
+        const int64_t yUpTo = std::upper_bound(run.SortedYs.begin() + yBelow, run.SortedYs.end(), y) - run.SortedYs.begin();
+        TiedX += xUpTo - xBelow;
+        TiedY += yUpTo - yBelow;
+
+        // Without ties in the run all four quadrants follow from one count.
+        const int64_t lowerLeft = run.RankLess(xBelow, yBelow);
+        if (xUpTo == xBelow && yUpTo == yBelow) {
+            ConcordanceBalance += 4 * lowerLeft - 2 * xBelow - 2 * yBelow + size;
+            return;
+        }
+        const int64_t upperLeft = xBelow - run.RankLess(xBelow, yUpTo);
+        const int64_t lowerRight = yBelow - run.RankLess(xUpTo, yBelow);
+        const int64_t upperRight = (size - yUpTo) - (xUpTo - run.RankLess(xUpTo, yUpTo));
+        ConcordanceBalance += lowerLeft + upperRight - upperLeft - lowerRight;
+    }
+
+    void Flush() {
+        std::sort(Buffer.begin(), Buffer.end());
+        std::vector<std::pair<double, double>> points;
+        points.swap(Buffer);
+
+        size_t level = 0;
+        for (; level < Runs.size() && Runs[level].Size(); ++level) {
+            const TRun& run = Runs[level];
+            std::vector<std::pair<double, double>> merged;
+            merged.reserve(points.size() + run.Size());
+            size_t i = 0;
+            for (const std::pair<double, double>& point : points) {
+                for (; i < run.Size() && std::make_pair(run.Xs[i], run.Ys[i]) < point; ++i) {
+                    merged.push_back(std::make_pair(run.Xs[i], run.Ys[i]));
+                }
+                merged.push_back(point);
+            }
+            for (; i < run.Size(); ++i) {
+                merged.push_back(std::make_pair(run.Xs[i], run.Ys[i]));
+            }
+            points.swap(merged);
+            Runs[level] = TRun();
+        }
+        if (level == Runs.size()) {
+            Runs.emplace_back();
+        }
+        Runs[level] = Build(points);
+    }
+
+    // points are sorted by x; equal y values get consecutive ranks.
+    static TRun Build(const std::vector<std::pair<double, double>>& points) {
+        const size_t size = points.size();
+        TRun run;
+        run.Xs.resize(size);
+        run.Ys.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            run.Xs[i] = points[i].first;
+            run.Ys[i] = points[i].second;
+        }
+
+        std::vector<uint32_t> order(size);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&run](const uint32_t left, const uint32_t right) {
+            return run.Ys[left] < run.Ys[right];
+        });
+        std::vector<uint32_t> ranks(size);
+        run.SortedYs.resize(size);
+        for (size_t rank = 0; rank < size; ++rank) {
+            ranks[order[rank]] = rank;
+            run.SortedYs[rank] = run.Ys[order[rank]];
+        }
+
+        size_t levelsCount = 1;
+        while (size > ((size_t) 1 << levelsCount)) {
+            ++levelsCount;
+        }
+        run.Levels.resize(levelsCount);
+        std::vector<uint32_t> next(size);
+        for (size_t level = 0; level < levelsCount; ++level) {
+            const size_t shift = levelsCount - 1 - level;
+            TBitVector& bits = run.Levels[level];
+            bits.Words.assign(size / 64 + 1, TBitVector::TWord());
+            for (size_t i = 0; i < size; ++i) {
+                bits.Words[i / 64].Bits |= (uint64_t) (ranks[i] >> shift & 1) << (i % 64);
+            }
+            for (size_t word = 1; word < bits.Words.size(); ++word) {
+                bits.Words[word].Rank = bits.Words[word - 1].Rank + __builtin_popcountll(bits.Words[word - 1].Bits);
+            }
+            bits.Zeros = size - bits.Rank1(size);
+
+            size_t zeros = 0;
+            size_t ones = bits.Zeros;
+            for (size_t i = 0; i < size; ++i) {
+                next[ranks[i] >> shift & 1 ? ones++ : zeros++] = ranks[i];
+            }
+            ranks.swap(next);
+        }
+        return run;
+    }
+};
+
+// Sums over the points seen so far of 1, y, x and x * y, kept in a Fenwick tree by y rank.
+struct TDistanceSums {
+    double Count = 0.;
+    double SumY = 0.;
+    double SumX = 0.;
+    double SumProducts = 0.;
+
+    TDistanceSums& operator += (const TDistanceSums& other) {
+        Count += other.Count;
+        SumY += other.SumY;
+        SumX += other.SumX;
+        SumProducts += other.SumProducts;
+        return *this;
+    }
+
+    TDistanceSums& operator -= (const TDistanceSums& other) {
+        Count -= other.Count;
+        SumY -= other.SumY;
+        SumX -= other.SumX;
+        SumProducts -= other.SumProducts;
+        return *this;
+    }
+};
+
+// sum_j |v_i - v_j| for every i, from the order that sorts values.
+std::vector<double> DistanceRowSums(const std::vector<double>& values, const std::vector<size_t>& order) {
+    const size_t count = values.size();
+    const double total = std::accumulate(values.begin(), values.end(), 0.);
+    std::vector<double> rowSums(count);
+    double prefix = 0.;
+    for (size_t rank = 0; rank < count; ++rank) {
+        const double value = values[order[rank]];
+        rowSums[order[rank]] = value * rank - prefix + (total - prefix - value) - value * (count - rank - 1);
+        prefix += value;
+    }
+    return rowSums;
+}
+
+// Squared distance variance from the row sums: mean of a_ij^2 + mean(a)^2 - 2 * mean of
+// squared row means, where sum_ij (v_i - v_j)^2 = 2 n sum v^2 - 2 (sum v)^2.
+double DistanceVariance(const std::vector<double>& values, const std::vector<double>& rowSums) {
+    const double count = values.size();
+    double sum = 0.;
+    double sumSquares = 0.;
+    double sumRows = 0.;
+    double sumRowSquares = 0.;
+    for (size_t i = 0; i < values.size(); ++i) {
+        sum += values[i];
+        sumSquares += values[i] * values[i];
+        sumRows += rowSums[i];
+        sumRowSquares += rowSums[i] * rowSums[i];
+    }
+    const double squaredDistances = 2. * count * sumSquares - 2. * sum * sum;
+    return squaredDistances / (count * count) + sumRows * sumRows / (count * count * count * count) - 2. * sumRowSquares / (count * count * count);
+}
+
+// Sample distance correlation in O(n log n) (Huo and Szekely): the row sums of the distance
+// matrices come from sorted prefix sums, and sum_ij |x_i - x_j| |y_i - y_j| from one sweep
+// in x order that keeps Fenwick sums of the swept points by y rank, split into the points
+// below and above the current y.
+double DistanceCorrelation(const double* xs, const double* ys, const size_t count) {
+    if (count < 2) {
+        throw std::invalid_argument("distance correlation needs at least two samples");
+    }
+
+    // Distances do not depend on the means; centring keeps the sweep sums small.
+    const double meanX = std::accumulate(xs, xs + count, 0.) / count;
+    const double meanY = std::accumulate(ys, ys + count, 0.) / count;
+    std::vector<double> x(count);
+    std::vector<double> y(count);
+    for (size_t i = 0; i < count; ++i) {
+        x[i] = xs[i] - meanX;
+        y[i] = ys[i] - meanY;
+    }
+
+    std::vector<size_t> orderX(count);
+    std::vector<size_t> orderY(count);
+    std::iota(orderX.begin(), orderX.end(), 0);
+    std::iota(orderY.begin(), orderY.end(), 0);
+    std::sort(orderX.begin(), orderX.end(), [&x](const size_t left, const size_t right) { return x[left] < x[right]; });
+    std::sort(orderY.begin(), orderY.end(), [&y](const size_t left, const size_t right) { return y[left] < y[right]; });
+
+    // Tied y values share the rank of their first occurrence, so prefix sums up to a rank
+    // exclude them.
+    std::vector<size_t> rankY(count);
+    for (size_t rank = 0; rank < count; ++rank) {
+        const bool tied = rank && y[orderY[rank]] == y[orderY[rank - 1]];
+        rankY[orderY[rank]] = tied ? rankY[orderY[rank - 1]] : rank;
+    }
+
+    std::vector<TDistanceSums> tree(count + 1);
+    TDistanceSums total;
+    double crossSum = 0.;
+    for (const size_t i : orderX) {
+        TDistanceSums below;
+        for (size_t node = rankY[i]; node; node &= node - 1) {
+            below += tree[node];
+        }
+        TDistanceSums above = total;
+        above -= below;
+
+        const double belowTerm = below.Count * x[i] * y[i] - x[i] * below.SumY - y[i] * below.SumX + below.SumProducts;
+        const double aboveTerm = above.Count * x[i] * y[i] - x[i] * above.SumY - y[i] * above.SumX + above.SumProducts;
+        crossSum += belowTerm - aboveTerm;
+
+        TDistanceSums point;
+        point.Count = 1.;
+        point.SumY = y[i];
+        point.SumX = x[i];
+        point.SumProducts = x[i] * y[i];
+        for (size_t node = rankY[i] + 1; node <= count; node += node & -node) {
+            tree[node] += point;
+        }
+        total += point;
+    }
+
+    const std::vector<double> rowsX = DistanceRowSums(x, orderX);
+    const std::vector<double> rowsY = DistanceRowSums(y, orderY);
+    double sumRowsX = 0.;
+    double sumRowsY = 0.;
+    double sumRowProducts = 0.;
+    for (size_t i = 0; i < count; ++i) {
+        sumRowsX += rowsX[i];
+        sumRowsY += rowsY[i];
+        sumRowProducts += rowsX[i] * rowsY[i];
+    }
+
+    const double n = count;
+    const double covariance = 2. * crossSum / (n * n) + sumRowsX * sumRowsY / (n * n * n * n) - 2. * sumRowProducts / (n * n * n);
+    const double variances = DistanceVariance(x, rowsX) * DistanceVariance(y, rowsY);
+    if (variances <= 0.) {
+        return 0.;
+    }
+    return sqrt(std::max(covariance, 0.) / sqrt(variances));
+}
+
+struct TSeriesPair {
+    const double* Xs;
+    const double* Ys;
+    size_t Count;
+};
+
+// threadsCount 0 stands for every core.
+size_t ThreadsCount(const size_t threadsCount) {
+    return threadsCount ? threadsCount : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+// Runs body(task, thread) for every task below tasksCount on threadsCount threads, the calling
+// one included, with thread below ThreadsCount(threadsCount); threads take tasks one at a
+// time, so tasks of different cost balance out.
+void ParallelFor(const size_t tasksCount, size_t threadsCount, const std::function<void(size_t, size_t)>& body) {
+    threadsCount = std::max<size_t>(std::min(ThreadsCount(threadsCount), tasksCount), 1);
+
+    std::atomic<size_t> next(0);
+    const auto work = [tasksCount, &body, &next](const size_t thread) {
+        for (size_t task = next++; task < tasksCount; task = next++) {
+            body(task, thread);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t thread = 1; thread < threadsCount; ++thread) {
+        threads.emplace_back(work, thread);
+    }
+    work(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Distance correlation of every pair, pairs spread over threadsCount threads.
+std::vector<double> DistanceCorrelations(const std::vector<TSeriesPair>& pairs, const size_t threadsCount = 0) {
+    std::vector<double> correlations(pairs.size());
+    ParallelFor(pairs.size(), threadsCount, [&pairs, &correlations](const size_t i, size_t) {
+        correlations[i] = DistanceCorrelation(pairs[i].Xs, pairs[i].Ys, pairs[i].Count);
+    });
+    return correlations;
+}
+
+// Rolling least squares of y on factorsCount factors over the last window samples, with an
+// optional intercept column. The Cholesky factor of X'X + ridge * I follows the window with
+// a rank-1 update for the entering row and a rank-1 downdate for the leaving one, so a step
+// costs O(k^2) instead of the O(k^3) of refactoring. Rounding errors of the updates would
+// accumulate over a long stream, so the factor is rebuilt from the window every Window
+// steps, at an amortized O(k^2 + k^3 / Window), and whenever a downdate would lose positive
+// definiteness. With an intercept, factors and responses are centred against a shift that
+// starts at the first sample and moves to the window means on every rebuild, so large means
+// do not square the condition number of X'X.
+class TRollingRegression {
+private:
+    size_t FactorsCount;
+    size_t Dimension;
+    size_t Window;
+    bool Intercept;
+    double Ridge;
+
+    // Ring buffer of the design rows and responses in the window.
+    std::vector<double> Rows;
+    std::vector<double> Responses;
+    size_t Count = 0;
+    size_t Next = 0;
+
+    // Subtracted from the design rows and responses; zero without an intercept.
+    std::vector<double> Shift;
+    double ResponseShift = 0.;
+    size_t StepsSinceRefactor = 0;
+
+    // Lower triangle of the Cholesky factor of the centred rows, row-major Dimension x
+    // Dimension, and the centred X'y.
+    std::vector<double> Factor;
+    std::vector<double> SumResponseProducts;
+    std::vector<double> Work;
+public:
+    TRollingRegression(const size_t factorsCount, const size_t window, const bool intercept = true, const double ridge = 1e-9)
+        : FactorsCount(factorsCount)
+        , Dimension(factorsCount + (intercept ? 1 : 0))
+        , Window(window)
+        , Intercept(intercept)
+        , Ridge(ridge)
+        , Rows(window * Dimension)
+        , Responses(window)
+        , Shift(Dimension)
+        , SumResponseProducts(Dimension)
+        , Work(Dimension)
+    {
+        if (!Dimension || !window) {
+            throw std::invalid_argument("regression needs at least one regressor and a non-empty window");
+        }
+        if (!(ridge > 0.)) {
+            throw std::invalid_argument("ridge must be positive to keep the factor definite");
+        }
+        Refactor();
+    }
+
+    // Adds a sample of factorsCount factor values and drops the oldest one once the window is full.
+    void Add(const double* factors, const double y) {
+        if (!Count && Intercept) {
+            std::copy(factors, factors + FactorsCount, Shift.begin() + 1);
+            ResponseShift = y;
+        }
+
+        double* row = &Rows[Next * Dimension];
+        if (Count == Window) {
+            if (++StepsSinceRefactor == Window) {
+                StoreRow(row, factors, y);
+                Next = (Next + 1) % Window;
+                Refactor();
+                return;
+            }
+
+            const double oldY = Responses[Next] - ResponseShift;
+            Centre(row);
+            for (size_t i = 0; i < Dimension; ++i) {
+                SumResponseProducts[i] -= Work[i] * oldY;
+            }
+            if (!Downdate()) {
+                StoreRow(row, factors, y);
+                Next = (Next + 1) % Window;
+                Refactor();
+                return;
+            }
+        } else {
+            ++Count;
+        }
+
+        StoreRow(row, factors, y);
+        Next = (Next + 1) % Window;
+        Centre(row);
+        for (size_t i = 0; i < Dimension; ++i) {
+            SumResponseProducts[i] += Work[i] * (y - ResponseShift);
+        }
+        Update();
+    }
+
+    // Intercept first when enabled, then one coefficient per factor.
+    void Solve(double* coefficients) const {
+        // Forward substitution with L, then back substitution with L'.
+        for (size_t i = 0; i < Dimension; ++i) {
+            double value = SumResponseProducts[i];
+            for (size_t j = 0; j < i; ++j) {
+                value -= Factor[i * Dimension + j] * coefficients[j];
+            }
+            coefficients[i] = value / Factor[i * Dimension + i];
+        }
+        for (size_t i = Dimension; i-- > 0;) {
+            double value = coefficients[i];
+            for (size_t j = i + 1; j < Dimension; ++j) {
+                value -= Factor[j * Dimension + i] * coefficients[j];
+            }
+            coefficients[i] = value / Factor[i * Dimension + i];
+        }
+
+        // Undoes the centring: y - s_y = a + b (f - s) means y = a + s_y - b s + b f.
+        if (Intercept) {
+            coefficients[0] += ResponseShift;
+            for (size_t i = 1; i < Dimension; ++i) {
+                coefficients[0] -= coefficients[i] * Shift[i];
+            }
+        }
+    }
+
+    std::vector<double> Coefficients() const {
+        std::vector<double> coefficients(Dimension);
+        Solve(coefficients.data());
+        return coefficients;
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+
+    size_t GetDimension() const {
+        return Dimension;
+    }
+private:
+    void StoreRow(double* row, const double* factors, const double y) {
+        if (Intercept) {
+            *row++ = 1.;
+        }
+        std::copy(factors, factors + FactorsCount, row);
+        Responses[Next] = y;
+    }
+
+    // Work = row - Shift.
+    void Centre(const double* row) {
+        for (size_t i = 0; i < Dimension; ++i) {
+            Work[i] = row[i] - Shift[i];
+        }
+    }
+
+    // L L' + w w' for w in Work; Work is destroyed.
+    void Update() {
+        for (size_t k = 0; k < Dimension; ++k) {
+            double& diagonal = Factor[k * Dimension + k];
+            const double radius = hypot(diagonal, Work[k]);
+            const double cosine = radius / diagonal;
+            const double sine = Work[k] / diagonal;
+            diagonal = radius;
+            for (size_t i = k + 1; i < Dimension; ++i) {
+                double& entry = Factor[i * Dimension + k];
+                entry = (entry + sine * Work[i]) / cosine;
+                Work[i] = cosine * Work[i] - sine * entry;
+            }
+        }
+    }
+
+    // L L' - w w' for w in Work; false if the result is not numerically positive definite,
+    // in which case the factor is left half-modified and has to be rebuilt.
+    bool Downdate() {
+        for (size_t k = 0; k < Dimension; ++k) {
+            double& diagonal = Factor[k * Dimension + k];
+            const double squared = (diagonal - Work[k]) * (diagonal + Work[k]);
+            if (!(squared > Ridge * std::numeric_limits<double>::epsilon())) {
+                return false;
+            }
+            const double radius = sqrt(squared);
+            const double cosine = radius / diagonal;
+            const double sine = Work[k] / diagonal;
+            diagonal = radius;
+            for (size_t i = k + 1; i < Dimension; ++i) {
+                double& entry = Factor[i * Dimension + k];
+                entry = (entry - sine * Work[i]) / cosine;
+                Work[i] = cosine * Work[i] - sine * entry;
+            }
+        }
+        return true;
+    }
+
+    // Moves the shift to the means of the Count newest rows and rebuilds the factor and X'y
+    // from them.
+    void Refactor() {
+        StepsSinceRefactor = 0;
+        if (Intercept && Count) {
+            std::fill(Shift.begin(), Shift.end(), 0.);
+            ResponseShift = 0.;
+            for (size_t slot = 0; slot < Count; ++slot) {
+                for (size_t i = 1; i < Dimension; ++i) {
+                    Shift[i] += Rows[slot * Dimension + i] / Count;
+                }
+                ResponseShift += Responses[slot] / Count;
+            }
+        }
+
+        std::vector<double> gram(Dimension * Dimension, 0.);
+        std::fill(SumResponseProducts.begin(), SumResponseProducts.end(), 0.);
+        for (size_t n = 0; n < Count; ++n) {
+            const size_t slot = (Next + Window - Count + n) % Window;
+            Centre(&Rows[slot * Dimension]);
+            const double response = Responses[slot] - ResponseShift;
+            for (size_t i = 0; i < Dimension; ++i) {
+                for (size_t j = 0; j <= i; ++j) {
+                    gram[i * Dimension + j] += Work[i] * Work[j];
+                }
+                SumResponseProducts[i] += Work[i] * response;
+            }
+        }
+
+        Factor.assign(Dimension * Dimension, 0.);
+        for (size_t i = 0; i < Dimension; ++i) {
+            gram[i * Dimension + i] += Ridge;
+            for (size_t j = 0; j <= i; ++j) {
+                double value = gram[i * Dimension + j];
+                for (size_t k = 0; k < j; ++k) {
+                    value -= Factor[i * Dimension + k] * Factor[j * Dimension + k];
+                }
+                if (i == j) {
+                    if (!(value > 0.)) {
+                        throw std::runtime_error("regression design matrix is not positive definite");
+                    }
+                    Factor[i * Dimension + i] = sqrt(value);
+                } else {
+                    Factor[i * Dimension + j] = value / Factor[j * Dimension + j];
+                }
+            }
+        }
+    }
+};
+
+// Covariance matrix of dimension-variate samples together with the Ledoit-Wolf shrinkage
+// towards m * I, m the mean variance, in a single pass. The intensity needs
+// Q = sum_k ||x_k - mean||^4; like the co-moments C it is kept about the mean, along with
+// W = sum_k ||x_k - mean||^2 (x_k - mean), so nothing is recovered from raw sums. Samples are
+// buffered in blocks that are centred on their own two-pass mean, and a block is merged into
+// the totals by moving both sets of aggregates to the combined mean. Means are kept relative
+// to the first sample, so rounding them costs ulps of the drift rather than of the level.
+// Moving n samples' aggregates from their mean by delta gives
+//   Q + 4 delta' C delta - 4 W . delta + 2 |delta|^2 tr C + n |delta|^4,
+//   W - 2 C delta - tr C delta - n |delta|^2 delta,
+//   C + n delta delta'.
+class TLedoitWolfCovarianceCalculator {
+private:
+    struct TMoments {
+        size_t Count = 0;
+        std::vector<double> Mean;
+        // Lower triangle, row-major Dimension x Dimension.
+        std::vector<double> CoMoments;
+        std::vector<double> Weighted;
+        double Quartic = 0.;
+
+        explicit TMoments(const size_t dimension)
+            : Mean(dimension)
+            , CoMoments(dimension * dimension)
+            , Weighted(dimension)
+        {
+        }
+    };
+
+    static const size_t BlockSize = 256;
+
+    size_t Dimension;
+    std::vector<double> Pivot;
+    mutable TMoments Total;
+    mutable TMoments Block;
+    mutable std::vector<double> Samples;
+    mutable std::vector<double> Shift;
+    mutable std::vector<double> CoMomentsShift;
+public:
+    explicit TLedoitWolfCovarianceCalculator(const size_t dimension)
+        : Dimension(dimension)
+        , Pivot(dimension)
+        , Total(dimension)
+        , Block(dimension)
+        , Samples(BlockSize * dimension)
+        , Shift(dimension)
+        , CoMomentsShift(dimension)
+    {
+        if (!dimension) {
+            throw std::invalid_argument("covariance needs at least one variable");
+        }
+    }
+
+    // One sample of Dimension values.
+    void Add(const double* sample) {
+        if (!GetCount()) {
+            std::copy(sample, sample + Dimension, Pivot.begin());
+        }
+        double* shifted = &Samples[Block.Count * Dimension];
+        for (size_t i = 0; i < Dimension; ++i) {
+            shifted[i] = sample[i] - Pivot[i];
+        }
+        if (++Block.Count == BlockSize) {
+            Flush();
+        }
+    }
+
+    // count samples stored row by row.
+    void AddBatch(const double* samples, const size_t count) {
+        for (size_t k = 0; k < count; ++k) {
+            Add(samples + k * Dimension);
+        }
+    }
+
+    double Covariation(const size_t i, const size_t j) const {
+        Flush();
+        return Total.CoMoments[std::max(i, j) * Dimension + std::min(i, j)] / Total.Count;
+    }
+
+    // Sample covariance matrix, row-major, normalized by the count like Covariation().
+    std::vector<double> Covariance() const {
+        std::vector<double> covariance(Dimension * Dimension);
+        for (size_t i = 0; i < Dimension; ++i) {
+            for (size_t j = 0; j <= i; ++j) {
+                covariance[i * Dimension + j] = covariance[j * Dimension + i] = Covariation(i, j);
+            }
+        }
+        return covariance;
+    }
+
+    // Weight of the scaled identity target: min(b^2, d^2) / d^2 with d^2 = ||S - m I||^2 and
+    // b^2 = sum_k ||x_k x_k' - S||^2 / n^2 = (sum_k ||x_k - mean||^4 - n ||S||^2) / n^2.
+    double ShrinkageIntensity() const {
+        Flush();
+        if (!Total.Count) {
+            throw std::runtime_error("shrinkage needs at least one sample");
+        }
+
+        const double n = Total.Count;
+        double trace = 0.;
+        double squaredNorm = 0.;
+        for (size_t i = 0; i < Dimension; ++i) {
+            trace += Covariation(i, i);
+            for (size_t j = 0; j <= i; ++j) {
+                const double covariation = Covariation(i, j);
+                squaredNorm += (i == j ? 1. : 2.) * covariation * covariation;
+            }
+        }
+        const double target = trace / Dimension;
+        const double dispersion = squaredNorm - Dimension * target * target;
+        if (!(dispersion > 0.)) {
+            return 1.;
+        }
+
+        const double spread = std::max(Total.Quartic - n * squaredNorm, 0.) / (n * n);
+        return std::min(spread, dispersion) / dispersion;
+    }
+
+    // (1 - delta) S + delta m I with delta the shrinkage intensity.
+    std::vector<double> ShrunkCovariance() const {
+        const double intensity = ShrinkageIntensity();
+        std::vector<double> covariance = Covariance();
+        double trace = 0.;
+        for (size_t i = 0; i < Dimension; ++i) {
+            trace += covariance[i * Dimension + i];
+        }
+        for (double& value : covariance) {
+            value *= 1. - intensity;
+        }
+        for (size_t i = 0; i < Dimension; ++i) {
+            covariance[i * Dimension + i] += intensity * trace / Dimension;
+        }
+        return covariance;
+    }
+
+    size_t GetCount() const {
+        return Total.Count + Block.Count;
+    }
+
+    size_t GetDimension() const {
+        return Dimension;
+    }
+private:
+    // Centres the buffered block and merges it into the totals.
+    void Flush() const {
+        if (!Block.Count) {
+            return;
+        }
+
+        const double count = Block.Count;
+        for (size_t i = 0; i < Dimension; ++i) {
+            double sum = 0.;
+            for (size_t k = 0; k < Block.Count; ++k) {
+                sum += Samples[k * Dimension + i];
+            }
+            const double mean = sum / count;
+            double correction = 0.;
+            for (size_t k = 0; k < Block.Count; ++k) {
+                correction += Samples[k * Dimension + i] - mean;
+            }
+            Block.Mean[i] = mean + correction / count;
+        }
+
+        std::fill(Block.CoMoments.begin(), Block.CoMoments.end(), 0.);
+        std::fill(Block.Weighted.begin(), Block.Weighted.end(), 0.);
+        Block.Quartic = 0.;
+        for (size_t k = 0; k < Block.Count; ++k) {
+            double* deviation = &Samples[k * Dimension];
+            double squaredNorm = 0.;
+            for (size_t i = 0; i < Dimension; ++i) {
+                deviation[i] -= Block.Mean[i];
+                squaredNorm += deviation[i] * deviation[i];
+            }
+            Block.Quartic += squaredNorm * squaredNorm;
+            for (size_t i = 0; i < Dimension; ++i) {
+                Block.Weighted[i] += squaredNorm * deviation[i];
+                double* row = &Block.CoMoments[i * Dimension];
+                for (size_t j = 0; j <= i; ++j) {
+                    row[j] += deviation[i] * deviation[j];
+                }
+            }
+        }
+
+        const double totalCount = Total.Count + count;
+        for (size_t i = 0; i < Dimension; ++i) {
+            Shift[i] = (Block.Mean[i] - Total.Mean[i]) * (count / totalCount);
+        }
+        MoveMean(Total);
+        for (size_t i = 0; i < Dimension; ++i) {
+            Total.Mean[i] += Shift[i];
+            Shift[i] = Total.Mean[i] - Block.Mean[i];
+        }
+        MoveMean(Block);
+
+        for (size_t i = 0; i < Dimension; ++i) {
+            Total.Weighted[i] += Block.Weighted[i];
+            for (size_t j = 0; j <= i; ++j) {
+                Total.CoMoments[i * Dimension + j] += Block.CoMoments[i * Dimension + j];
+            }
+        }
+        Total.Quartic += Block.Quartic;
+        Total.Count += Block.Count;
+        Block.Count = 0;
+    }
+
+    // Moves the aggregates of moments from their mean by Shift.
+    void MoveMean(TMoments& moments) const {
+        const double n = moments.Count;
+        std::fill(CoMomentsShift.begin(), CoMomentsShift.end(), 0.);
+        double trace = 0.;
+        for (size_t i = 0; i < Dimension; ++i) {
+            const double* row = &moments.CoMoments[i * Dimension];
+            for (size_t j = 0; j < i; ++j) {
+                CoMomentsShift[i] += row[j] * Shift[j];
+                CoMomentsShift[j] += row[j] * Shift[i];
+            }
+            CoMomentsShift[i] += row[i] * Shift[i];
+            trace += row[i];
+        }
+
+        double quadratic = 0.;
+        double weightedShift = 0.;
+        double shiftNorm = 0.;
+        for (size_t i = 0; i < Dimension; ++i) {
+            quadratic += CoMomentsShift[i] * Shift[i];
+            weightedShift += moments.Weighted[i] * Shift[i];
+            shiftNorm += Shift[i] * Shift[i];
+        }
+
+        moments.Quartic += 4. * quadratic - 4. * weightedShift + 2. * shiftNorm * trace + n * shiftNorm * shiftNorm;
+        for (size_t i = 0; i < Dimension; ++i) {
+            moments.Weighted[i] -= 2. * CoMomentsShift[i] + (trace + n * shiftNorm) * Shift[i];
+            double* row = &moments.CoMoments[i * Dimension];
+            for (size_t j = 0; j <= i; ++j) {
+                row[j] += n * Shift[i] * Shift[j];
+            }
+        }
+    }
+};
+
+// Eigen-decomposition of the symmetric size x size matrix by cyclic Jacobi rotations.
+// matrix is destroyed; vectors gets the eigenvectors as rows, sorted with the values in
+// decreasing order.
+void SymmetricEigen(std::vector<double>& matrix, const size_t size, std::vector<double>& values, std::vector<double>& vectors) {
+    vectors.assign(size * size, 0.);
+    for (size_t i = 0; i < size; ++i) {
+        vectors[i * size + i] = 1.;
+    }
+
+    for (size_t sweep = 0; sweep < 64; ++sweep) {
+        double offDiagonal = 0.;
+        double diagonal = 0.;
+        for (size_t i = 0; i < size; ++i) {
+            diagonal += matrix[i * size + i] * matrix[i * size + i];
+            for (size_t j = i + 1; j < size; ++j) {
+                offDiagonal += matrix[i * size + j] * matrix[i * size + j];
+            }
+        }
+        if (offDiagonal <= std::numeric_limits<double>::epsilon() * std::numeric_limits<double>::epsilon() * diagonal) {
+            break;
+        }
+
+        for (size_t p = 0; p < size; ++p) {
+            for (size_t q = p + 1; q < size; ++q) {
+                const double apq = matrix[p * size + q];
+                if (apq == 0.) {
+                    continue;
+                }
+                const double theta = (matrix[q * size + q] - matrix[p * size + p]) / (2. * apq);
+                const double t = (theta >= 0. ? 1. : -1.) / (fabs(theta) + sqrt(theta * theta + 1.));
+                const double c = 1. / sqrt(t * t + 1.);
+                const double s = t * c;
+                for (size_t k = 0; k < size; ++k) {
+                    const double akp = matrix[k * size + p];
+                    const double akq = matrix[k * size + q];
+                    matrix[k * size + p] = c * akp - s * akq;
+                    matrix[k * size + q] = s * akp + c * akq;
+                }
+                for (size_t k = 0; k < size; ++k) {
+                    const double apk = matrix[p * size + k];
+                    const double aqk = matrix[q * size + k];
+                    matrix[p * size + k] = c * apk - s * aqk;
+                    matrix[q * size + k] = s * apk + c * aqk;
+                }
+                for (size_t k = 0; k < size; ++k) {
+                    const double vpk = vectors[p * size + k];
+                    const double vqk = vectors[q * size + k];
+                    vectors[p * size + k] = c * vpk - s * vqk;
+                    vectors[q * size + k] = s * vpk + c * vqk;
+                }
+            }
+        }
+    }
+
+    std::vector<size_t> order(size);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&matrix, size](const size_t left, const size_t right) {
+        return matrix[left * size + left] > matrix[right * size + right];
+    });
+    values.resize(size);
+    std::vector<double> sorted(size * size);
+    for (size_t i = 0; i < size; ++i) {
+        values[i] = matrix[order[i] * size + order[i]];
+        std::copy(&vectors[order[i] * size], &vectors[order[i] * size] + size, &sorted[i * size]);
+    }
+    vectors.swap(sorted);
+}
+
+// Low-rank covariance of high-dimensional samples in O(dimension * rank) memory by Frequent
+// Directions (Liberty; Ghashami et al.). Samples fill a sketch of 2 * rank rows; a full
+// sketch is rotated onto its right singular vectors and every squared singular value is
+// reduced by the (rank + 1)-th largest, which zeroes half of the rows. The sketch B then
+// satisfies 0 <= A'A - B'B <= Delta in the spectral norm, Delta the sum of the reductions,
+// and Delta <= ||A||_F^2 / (rank + 1). A holds the samples shifted by the first one, not
+// centred: the sketch approximates second moments about the first sample and the mean is
+// subtracted afterwards, so the bound grows with ||A||_F^2, which includes the squared
+// distance of the mean from the first sample, not just the spread around the mean.
+class TFrequentDirectionsCovariance {
+private:
+    size_t Dimension;
+    size_t Rank;
+    size_t Count = 0;
+    size_t Filled = 0;
+    double Shrinkage = 0.;
+    std::vector<double> Shift;
+    std::vector<double> Sum;
+    // 2 * Rank rows of Dimension values.
+    std::vector<double> Sketch;
+public:
+    TFrequentDirectionsCovariance(const size_t dimension, const size_t rank)
+        : Dimension(dimension)
+        , Rank(rank)
+        , Shift(dimension)
+        , Sum(dimension)
+        , Sketch(2 * rank * dimension)
+    {
+        if (!dimension || !rank) {
+            throw std::invalid_argument("sketch needs a positive dimension and rank");
+        }
+    }
+
+    void Add(const double* sample) {
+        AddBatch(sample, 1);
+    }
+
+    // count samples stored row by row; the sketch is shrunk once per Rank new rows.
+    void AddBatch(const double* samples, const size_t count) {
+        for (size_t k = 0; k < count; ++k) {
+            const double* sample = samples + k * Dimension;
+            if (!Count) {
+                std::copy(sample, sample + Dimension, Shift.begin());
+            }
+            ++Count;
+
+            if (Filled == 2 * Rank) {
+                Shrink();
+            }
+            double* row = &Sketch[Filled++ * Dimension];
+            for (size_t i = 0; i < Dimension; ++i) {
+                row[i] = sample[i] - Shift[i];
+                Sum[i] += row[i];
+            }
+        }
+    }
+
+    double Covariation(const size_t i, const size_t j) const {
+        double product = 0.;
+        for (size_t row = 0; row < Filled; ++row) {
+            product += Sketch[row * Dimension + i] * Sketch[row * Dimension + j];
+        }
+        return product / Count - Sum[i] / Count * (Sum[j] / Count);
+    }
+
+    // Bound on the spectral norm of the error of the covariance matrix; every
+    // Covariation(i, j) is within it as well. It is relative to the shifted data, so it is
+    // loose when the mean moves far from the first sample.
+    double ErrorBound() const {
+        return Count ? Shrinkage / Count : 0.;
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+
+    size_t GetRank() const {
+        return Rank;
+    }
+private:
+    void Shrink() {
+        const size_t rows = Filled;
+        std::vector<double> gram(rows * rows);
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j <= i; ++j) {
+                double product = 0.;
+                const double* left = &Sketch[i * Dimension];
+                const double* right = &Sketch[j * Dimension];
+                for (size_t k = 0; k < Dimension; ++k) {
+                    product += left[k] * right[k];
+                }
+                gram[i * rows + j] = gram[j * rows + i] = product;
+            }
+        }
+
+        // B B' = U S^2 U', so the right singular vectors are the rows of S^-1 U' B.
+        std::vector<double> values;
+        std::vector<double> vectors;
+        SymmetricEigen(gram, rows, values, vectors);
+        const double reduction = std::max(values[Rank], 0.);
+        Shrinkage += reduction;
+
+        std::vector<double> shrunk(Sketch.size(), 0.);
+        Filled = 0;
+        for (size_t i = 0; i < Rank; ++i) {
+            const double squared = values[i] - reduction;
+            if (!(squared > 0.)) {
+                break;
+            }
+            const double scale = sqrt(squared / values[i]);
+            double* out = &shrunk[Filled++ * Dimension];
+            for (size_t j = 0; j < rows; ++j) {
+                const double weight = scale * vectors[i * rows + j];
+                const double* row = &Sketch[j * Dimension];
+                for (size_t k = 0; k < Dimension; ++k) {
+                    out[k] += weight * row[k];
+                }
+            }
+        }
+        Sketch.swap(shrunk);
+    }
+};
+
+// Count sketches of seriesCount series observed in lockstep. Each of depth rows hashes a
+// time step to one of width buckets with a random sign, so the sketches of two series give
+// an unbiased estimate of sum_t x_t y_t by their bucket-wise dot product; the median over
+// the rows holds with high probability within about ||x|| ||y|| / sqrt(width). Sketching is
+// linear, so subtracting mean times the sketch of the all-ones series centres a sketch at
+// query time and the error scales with the centred norms. Width trades space for accuracy:
+// the correlation error is of order 1 / sqrt(width). Values are shifted by the first time
+// step to keep the exact variances well conditioned.
+class TCountSketchCovariation {
+private:
+    static const size_t MaxDepth = 15;
+
+    size_t SeriesCount;
+    size_t Width;
+    size_t Depth;
+    uint64_t Seed;
+    size_t Count = 0;
+    std::vector<double> Shift;
+    std::vector<double> Shifted;
+    std::vector<double> Sums;
+    std::vector<double> SumSquares;
+    // SeriesCount sketches of Depth x Width buckets, series outermost so that a query streams
+    // two contiguous sketches; a time step scatters Depth updates into each of them. Storing
+    // series innermost would turn a step into Depth vectorized scaled adds across the series,
+    // but every query would then touch a cache line per bucket, and pair queries dominate.
+    std::vector<double> Sketches;
+    std::vector<double> OnesSketch;
+    std::vector<size_t> Buckets;
+    std::vector<double> Signs;
+public:
+    TCountSketchCovariation(const size_t seriesCount, const size_t width, const size_t depth = 5, const uint64_t seed = 1)
+        : SeriesCount(seriesCount)
+        , Width(width)
+        , Depth(depth)
+        , Seed(seed)
+        , Shift(seriesCount)
+        , Shifted(seriesCount)
+        , Sums(seriesCount)
+        , SumSquares(seriesCount)
+        , Sketches(seriesCount * depth * width)
+        , OnesSketch(depth * width)
+        , Buckets(depth)
+        , Signs(depth)
+    {
+        if (!seriesCount || !width || !depth) {
+            throw std::invalid_argument("sketch needs positive series count, width and depth");
+        }
+        if (depth > MaxDepth) {
+            throw std::invalid_argument("sketch depth must not exceed 15");
+        }
+    }
+
+    // One time step: the value of every series.
+    void Add(const double* values) {
+        if (!Count) {
+            std::copy(values, values + SeriesCount, Shift.begin());
+        }
+        for (size_t i = 0; i < SeriesCount; ++i) {
+            Shifted[i] = values[i] - Shift[i];
+            Sums[i] += Shifted[i];
+            SumSquares[i] += Shifted[i] * Shifted[i];
+        }
+
+        for (size_t row = 0; row < Depth; ++row) {
+            const uint64_t hash = MixBits(Seed * 0x100000001B3ULL + row * 0x9E3779B97F4A7C15ULL + Count);
+            Buckets[row] = row * Width + (size_t) ((hash >> 1) % Width);
+            Signs[row] = hash & 1 ? 1. : -1.;
+            OnesSketch[Buckets[row]] += Signs[row];
+        }
+        for (size_t i = 0; i < SeriesCount; ++i) {
+            double* sketch = &Sketches[i * Depth * Width];
+            for (size_t row = 0; row < Depth; ++row) {
+                sketch[Buckets[row]] += Signs[row] * Shifted[i];
+            }
+        }
+        ++Count;
+    }
+
+    // count time steps stored row by row.
+    void AddBatch(const double* values, const size_t count) {
+        for (size_t t = 0; t < count; ++t) {
+            Add(values + t * SeriesCount);
+        }
+    }
+
+    double Covariation(const size_t i, const size_t j) const {
+        const double meanI = Sums[i] / Count;
+        const double meanJ = Sums[j] / Count;
+        const double* sketchI = &Sketches[i * Depth * Width];
+        const double* sketchJ = &Sketches[j * Depth * Width];
+        double estimates[MaxDepth];
+        for (size_t row = 0; row < Depth; ++row) {
+            double product = 0.;
+            for (size_t bucket = row * Width; bucket < (row + 1) * Width; ++bucket) {
+                product += (sketchI[bucket] - meanI * OnesSketch[bucket]) * (sketchJ[bucket] - meanJ * OnesSketch[bucket]);
+            }
+            estimates[row] = product / Count;
+        }
+        std::nth_element(estimates, estimates + Depth / 2, estimates + Depth);
+        return estimates[Depth / 2];
+    }
+
+    // Sketched covariation over exact variances.
+    double Correlation(const size_t i, const size_t j) const {
+        return Covariation(i, j) / sqrt(Variance(i) * Variance(j));
+    }
+
+    double Variance(const size_t i) const {
+        const double mean = Sums[i] / Count;
+        return std::max(SumSquares[i] / Count - mean * mean, 0.);
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+};
+
+struct TCorrelatedPair {
+    size_t First;
+    size_t Second;
+    double Correlation;
+};
+
+// Screens a universe of equally long series for strongly correlated pairs without touching
+// all of them. Series are normalized to unit vectors, whose dot product is the correlation,
+// and signed with bandsCount bands of bitsPerBand random-hyperplane bits (SimHash): a bit
+// differs with probability angle / pi, so highly correlated series share a band with high
+// probability. Only pairs that share a band, or whose bands are complements for strongly
+// anticorrelated series, get their correlation computed exactly. Pairs are ranked by
+// absolute correlation and each is computed in the first band where it collides.
+class TCorrelationScreener {
+private:
+    std::vector<const double*> Series;
+    size_t Length;
+    size_t BandsCount;
+    size_t BitsPerBand;
+    size_t ThreadsNumber;
+    std::vector<double> Variances;
+    // BandsCount signatures per series.
+    std::vector<uint64_t> Signatures;
+    // Series of every bucket of every band, with the band of each bucket.
+    std::vector<std::vector<size_t>> Buckets;
+    std::vector<size_t> BucketBands;
+    std::vector<std::pair<size_t, size_t>> BucketPairs;
+public:
+    TCorrelationScreener(const std::vector<const double*>& series, const size_t length, const size_t bandsCount = 8,
+        const size_t bitsPerBand = 12, const uint64_t seed = 1, const size_t threadsCount = 0)
+        : Series(series)
+        , Length(length)
+        , BandsCount(bandsCount)
+        , BitsPerBand(bitsPerBand)
+        , ThreadsNumber(threadsCount)
+        , Variances(series.size())
+        , Signatures(series.size() * bandsCount)
+    {
+        if (length < 2 || !bandsCount || !bitsPerBand || bitsPerBand > 64) {
+            throw std::invalid_argument("screening needs two samples and 1 to 64 bits per band");
+        }
+
+        // Gaussian hyperplanes by Box-Muller over hashed uniforms.
+        const size_t bitsCount = bandsCount * bitsPerBand;
+        const double unit = 1. / ((uint64_t) 1 << 53);
+        const double pi = acos(-1.);
+        std::vector<double> planes(bitsCount * length);
+        for (size_t i = 0; i < planes.size(); ++i) {
+            const uint64_t first = MixBits(seed * 0x100000001B3ULL + 2 * i);
+            const uint64_t second = MixBits(seed * 0x100000001B3ULL + 2 * i + 1);
+            const double radius = sqrt(-2. * log(((first >> 11) + 1) * unit));
+            planes[i] = radius * cos(2. * pi * (second >> 11) * unit);
+        }
+
+        ParallelFor(Series.size(), ThreadsNumber, [this, &planes, bitsCount](const size_t index, size_t) {
+            const double* values = Series[index];
+            TWelfordCovariationCalculator moments;
+            moments.AddBatch(values, values, Length);
+            Variances[index] = moments.Covariation();
+
+            std::vector<double> normalized(Length);
+            for (size_t t = 0; t < Length; ++t) {
+                normalized[t] = values[t] - moments.GetMeanX();
+            }
+            for (size_t bit = 0; bit < bitsCount; ++bit) {
+                const double* plane = &planes[bit * Length];
+                double projection = 0.;
+                for (size_t t = 0; t < Length; ++t) {
+                    projection += normalized[t] * plane[t];
+                }
+                if (projection > 0.) {
+                    Signatures[index * BandsCount + bit / BitsPerBand] |= (uint64_t) 1 << (bit % BitsPerBand);
+                }
+            }
+        });
+
+        for (size_t band = 0; band < BandsCount; ++band) {
+            std::map<uint64_t, size_t> bandBuckets;
+            for (size_t index = 0; index < Series.size(); ++index) {
+                const auto inserted = bandBuckets.insert(std::make_pair(Signatures[index * BandsCount + band], Buckets.size()));
+                if (inserted.second) {
+                    Buckets.emplace_back();
+                    BucketBands.push_back(band);
+                }
+                Buckets[inserted.first->second].push_back(index);
+            }
+            // Each bucket pairs with itself and with its complement, once.
+            for (const std::pair<const uint64_t, size_t>& bucket : bandBuckets) {
+                BucketPairs.emplace_back(bucket.second, bucket.second);
+                const auto complement = bandBuckets.find(Complement(bucket.first));
+                if (complement != bandBuckets.end() && bucket.first < complement->first) {
+                    BucketPairs.emplace_back(bucket.second, complement->second);
+                }
+            }
+        }
+    }
+
+    // The topK candidate pairs with the largest absolute correlation.
+    std::vector<TCorrelatedPair> TopPairs(const size_t topK) const {
+        const auto less = [](const TCorrelatedPair& left, const TCorrelatedPair& right) {
+            return fabs(left.Correlation) > fabs(right.Correlation);
+        };
+        std::vector<std::vector<TCorrelatedPair>> heaps(ThreadsCount(ThreadsNumber));
+        Scan([topK, &heaps, &less](const TCorrelatedPair& pair, const size_t thread) {
+            std::vector<TCorrelatedPair>& heap = heaps[thread];
+            if (heap.size() < topK) {
+                heap.push_back(pair);
+                std::push_heap(heap.begin(), heap.end(), less);
+            } else if (topK && fabs(pair.Correlation) > fabs(heap.front().Correlation)) {
+                std::pop_heap(heap.begin(), heap.end(), less);
+                heap.back() = pair;
+                std::push_heap(heap.begin(), heap.end(), less);
+            }
+        });
+        return Collect(heaps, topK);
+    }
+
+    // Candidate pairs with absolute correlation of at least threshold.
+    std::vector<TCorrelatedPair> PairsAbove(const double threshold) const {
+        std::vector<std::vector<TCorrelatedPair>> found(ThreadsCount(ThreadsNumber));
+        Scan([threshold, &found](const TCorrelatedPair& pair, const size_t thread) {
+            if (fabs(pair.Correlation) >= threshold) {
+                found[thread].push_back(pair);
+            }
+        });
+        return Collect(found, std::numeric_limits<size_t>::max());
+    }
+
+    size_t BucketsCount() const {
+        return Buckets.size();
+    }
+private:
+    uint64_t Complement(const uint64_t signature) const {
+        return ~signature & (BitsPerBand == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << BitsPerBand) - 1);
+    }
+
+    bool Collide(const size_t first, const size_t second, const size_t band) const {
+        const uint64_t left = Signatures[first * BandsCount + band];
+        const uint64_t right = Signatures[second * BandsCount + band];
+        return left == right || left == Complement(right);
+    }
+
+    double Correlation(const size_t first, const size_t second) const {
+        TWelfordCovariationCalculator calculator;
+        calculator.AddBatch(Series[first], Series[second], Length);
+        return calculator.Covariation() / sqrt(Variances[first] * Variances[second]);
+    }
+
+    // Calls visit(pair, thread) for every candidate pair once, bucket pairs spread over threads.
+    void Scan(const std::function<void(const TCorrelatedPair&, size_t)>& visit) const {
+        ParallelFor(BucketPairs.size(), ThreadsNumber, [this, &visit](const size_t task, const size_t thread) {
+            const std::vector<size_t>& left = Buckets[BucketPairs[task].first];
+            const std::vector<size_t>& right = Buckets[BucketPairs[task].second];
+            const bool same = BucketPairs[task].first == BucketPairs[task].second;
+            const size_t band = BucketBands[BucketPairs[task].first];
+            for (size_t i = 0; i < left.size(); ++i) {
+                for (size_t j = same ? i + 1 : 0; j < right.size(); ++j) {
+                    const size_t first = std::min(left[i], right[j]);
+                    const size_t second = std::max(left[i], right[j]);
+                    bool seen = false;
+                    for (size_t earlier = 0; earlier < band && !seen; ++earlier) {
+                        seen = Collide(first, second, earlier);
+                    }
+                    if (!seen) {
+                        visit(TCorrelatedPair{first, second, Correlation(first, second)}, thread);
+                    }
+                }
+            }
+        });
+    }
+
+    static std::vector<TCorrelatedPair> Collect(const std::vector<std::vector<TCorrelatedPair>>& parts, const size_t limit) {
+        std::vector<TCorrelatedPair> pairs;
+        for (const std::vector<TCorrelatedPair>& part : parts) {
+            pairs.insert(pairs.end(), part.begin(), part.end());
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const TCorrelatedPair& left, const TCorrelatedPair& right) {
+            return fabs(left.Correlation) > fabs(right.Correlation);
+        });
+        pairs.resize(std::min(limit, pairs.size()));
+        return pairs;
+    }
+};
+
+// Open-addressing hash map from 64-bit keys to sums with linear probing; the table stays at
+// most half full. ~0 is reserved as the empty key.
+class TSparseAccumulator {
+private:
+    static const uint64_t EmptyKey = ~(uint64_t) 0;
+
+    std::vector<uint64_t> Keys;
+    std::vector<double> Values;
+    size_t Size = 0;
+public:
+    explicit TSparseAccumulator(const size_t capacity = 16) {
+        size_t slots = 16;
+        while (slots < 2 * capacity) {
+            slots *= 2;
+        }
+        Keys.assign(slots, EmptyKey);
+        Values.assign(slots, 0.);
+    }
+
+    void Add(const uint64_t key, const double value) {
+        if (2 * (Size + 1) > Keys.size()) {
+            Grow();
+        }
+        const size_t slot = Slot(key);
+        if (Keys[slot] == EmptyKey) {
+            Keys[slot] = key;
+            ++Size;
+        }
+        Values[slot] += value;
+    }
+
+    double Get(const uint64_t key) const {
+        const size_t slot = Slot(key);
+        return Keys[slot] == EmptyKey ? 0. : Values[slot];
+    }
+
+    size_t GetSize() const {
+        return Size;
+    }
+
+    template <class TVisitor>
+    void ForEach(const TVisitor& visit) const {
+        for (size_t slot = 0; slot < Keys.size(); ++slot) {
+            if (Keys[slot] != EmptyKey) {
+                visit(Keys[slot], Values[slot]);
+            }
+        }
+    }
+private:
+    // Slot holding key or the empty slot where it would go.
+    size_t Slot(const uint64_t key) const {
+        const size_t mask = Keys.size() - 1;
+        size_t slot = MixBits(key) & mask;
+        while (Keys[slot] != key && Keys[slot] != EmptyKey) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void Grow() {
+        std::vector<uint64_t> keys(2 * Keys.size(), EmptyKey);
+        std::vector<double> values(2 * Keys.size(), 0.);
+        keys.swap(Keys);
+        values.swap(Values);
+        for (size_t slot = 0; slot < keys.size(); ++slot) {
+            if (keys[slot] != EmptyKey) {
+                const size_t target = Slot(keys[slot]);
+                Keys[target] = keys[slot];
+                Values[target] = values[slot];
+            }
+        }
+    }
+};
+
+const uint64_t TSparseAccumulator::EmptyKey;
+
+// Covariance matrix of sparse observations over a huge feature space. A row only touches the
+// co-moments of its own nonzeros, kept with the per-feature sums in hash accumulators, and
+// the implicit zeros enter through the mean correction at query time:
+// Cov(i, j) = sum x_i x_j / n - (sum x_i / n) (sum x_j / n). Memory follows the number of
+// co-occurring feature pairs rather than the square of the dimension.
+class TSparseCovarianceCalculator {
+private:
+    static const uint32_t MaxColumn = ~(uint32_t) 0;
+
+    size_t Count = 0;
+    TSparseAccumulator Sums;
+    // Key (i << 32) | j with i <= j.
+    TSparseAccumulator SumProducts;
+public:
+    // One row of nonzerosCount (column, value) entries, columns distinct. Column ids stop below
+    // 2^32 - 1: PairKey(2^32 - 1, 2^32 - 1) would be the accumulator's empty key.
+    void Add(const uint32_t* columns, const double* values, const size_t nonzerosCount) {
+        for (size_t a = 0; a < nonzerosCount; ++a) {
+            if (columns[a] == MaxColumn) {
+                throw std::invalid_argument("sparse column id must be below 2^32 - 1");
+            }
+        }
+        for (size_t a = 0; a < nonzerosCount; ++a) {
+            Sums.Add(columns[a], values[a]);
+            for (size_t b = 0; b < nonzerosCount; ++b) {
+                if (columns[a] <= columns[b]) {
+                    SumProducts.Add(PairKey(columns[a], columns[b]), values[a] * values[b]);
+                }
+            }
+        }
+        ++Count;
+    }
+
+    // rowsCount rows in CSR form: row r spans [offsets[r], offsets[r + 1]) of columns and values.
+    void AddRows(const size_t* offsets, const uint32_t* columns, const double* values, const size_t rowsCount) {
+        for (size_t row = 0; row < rowsCount; ++row) {
+            Add(columns + offsets[row], values + offsets[row], offsets[row + 1] - offsets[row]);
+        }
+    }
+
+    double Covariation(const uint32_t i, const uint32_t j) const {
+        return SumProducts.Get(PairKey(std::min(i, j), std::max(i, j))) / Count - Mean(i) * Mean(j);
+    }
+
+    double Mean(const uint32_t i) const {
+        return Sums.Get(i) / Count;
+    }
+
+    // Calls visit(i, j, covariation) for every pair with i <= j that co-occurred in a row.
+    template <class TVisitor>
+    void ForEachPair(const TVisitor& visit) const {
+        SumProducts.ForEach([this, &visit](const uint64_t key, double) {
+            const uint32_t i = key >> 32;
+            const uint32_t j = (uint32_t) key;
+            visit(i, j, Covariation(i, j));
+        });
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+
+    size_t PairsCount() const {
+        return SumProducts.GetSize();
+    }
+private:
+    static uint64_t PairKey(const uint32_t i, const uint32_t j) {
+        return (uint64_t) i << 32 | j;
+    }
+};
+
+const uint32_t TSparseCovarianceCalculator::MaxColumn;
+
+// Undirected graph in CSR form: the neighbours of node i are Columns[Offsets[i]..Offsets[i + 1])
+// in increasing order, with the correlation of each edge alongside.
+struct TCorrelationGraph {
+    std::vector<size_t> Offsets;
+    std::vector<uint32_t> Columns;
+    std::vector<double> Correlations;
+};
+
+// Graph of the pairs of equally long series whose absolute correlation reaches threshold.
+// The correlation matrix is computed tile by tile over pairs of row tiles, upper triangle
+// only, normalizing the series of a tile on the fly; a thread holds two tiles of
+// tileSize x length values besides the edges it found, so peak memory is the tiles plus the
+// output instead of the square of the universe.
+TCorrelationGraph ThresholdedCorrelationGraph(const std::vector<const double*>& series, const size_t length,
+    const double threshold, const size_t tileSize = 256, const size_t threadsCount = 0)
+{
+    if (length < 2 || !tileSize) {
+        throw std::invalid_argument("correlation graph needs two samples and a positive tile size");
+    }
+
+    struct TEdge {
+        uint32_t First;
+        uint32_t Second;
+        double Correlation;
+    };
+
+    const size_t count = series.size();
+    std::vector<double> means(count);
+    std::vector<double> inverseNorms(count);
+    ParallelFor(count, threadsCount, [&series, length, &means, &inverseNorms](const size_t i, size_t) {
+        TWelfordCovariationCalculator moments;
+        moments.AddBatch(series[i], series[i], length);
+        means[i] = moments.GetMeanX();
+        const double norm = sqrt(moments.GetSumProducts());
+        inverseNorms[i] = norm > 0. ? 1. / norm : 0.;
+    });
+
+    const auto normalize = [&series, length, &means, &inverseNorms, count, tileSize](const size_t tile, std::vector<double>& values) {
+        const size_t begin = tile * tileSize;
+        const size_t end = std::min(begin + tileSize, count);
+        values.resize((end - begin) * length);
+        for (size_t i = begin; i < end; ++i) {
+            double* out = &values[(i - begin) * length];
+            for (size_t t = 0; t < length; ++t) {
+                out[t] = (series[i][t] - means[i]) * inverseNorms[i];
+            }
+        }
+        return end - begin;
+    };
+
+    const size_t tilesCount = (count + tileSize - 1) / tileSize;
+    std::vector<std::pair<size_t, size_t>> tilePairs;
+    for (size_t first = 0; first < tilesCount; ++first) {
+        for (size_t second = first; second < tilesCount; ++second) {
+            tilePairs.emplace_back(first, second);
+        }
+    }
+
+    std::vector<std::vector<TEdge>> edges(ThreadsCount(threadsCount));
+    ParallelFor(tilePairs.size(), threadsCount, [&](const size_t task, const size_t thread) {
+        std::vector<double> rows;
+        std::vector<double> columns;
+        const size_t firstTile = tilePairs[task].first;
+        const size_t secondTile = tilePairs[task].second;
+        const size_t rowsCount = normalize(firstTile, rows);
+        const size_t columnsCount = normalize(secondTile, columns);
+        for (size_t i = 0; i < rowsCount; ++i) {
+            const double* row = &rows[i * length];
+            for (size_t j = firstTile == secondTile ? i + 1 : 0; j < columnsCount; ++j) {
+                const double* column = &columns[j * length];
+                double correlation = 0.;
+                AccumulateChains(correlation, length, [row, column](const size_t t) { return row[t] * column[t]; });
+                if (fabs(correlation) >= threshold) {
+                    edges[thread].push_back(TEdge{(uint32_t) (firstTile * tileSize + i), (uint32_t) (secondTile * tileSize + j), correlation});
+                }
+            }
+        }
+    });
+
+    // Counting sort of both directions of every edge into rows.
+    TCorrelationGraph graph;
+    graph.Offsets.assign(count + 1, 0);
+    for (const std::vector<TEdge>& part : edges) {
+        for (const TEdge& edge : part) {
+            ++graph.Offsets[edge.First + 1];
+            ++graph.Offsets[edge.Second + 1];
+        }
+    }
+    std::partial_sum(graph.Offsets.begin(), graph.Offsets.end(), graph.Offsets.begin());
+    graph.Columns.resize(graph.Offsets.back());
+    graph.Correlations.resize(graph.Offsets.back());
+    std::vector<size_t> next(graph.Offsets.begin(), graph.Offsets.end() - 1);
+    for (std::vector<TEdge>& part : edges) {
+        for (const TEdge& edge : part) {
+            graph.Columns[next[edge.First]] = edge.Second;
+            graph.Correlations[next[edge.First]++] = edge.Correlation;
+            graph.Columns[next[edge.Second]] = edge.First;
+            graph.Correlations[next[edge.Second]++] = edge.Correlation;
+        }
+        std::vector<TEdge>().swap(part);
+    }
+
+    std::vector<std::pair<uint32_t, double>> neighbours;
+    for (size_t i = 0; i < count; ++i) {
+        neighbours.clear();
+        for (size_t k = graph.Offsets[i]; k < graph.Offsets[i + 1]; ++k) {
+            neighbours.emplace_back(graph.Columns[k], graph.Correlations[k]);
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        for (size_t k = 0; k < neighbours.size(); ++k) {
+            graph.Columns[graph.Offsets[i] + k] = neighbours[k].first;
+            graph.Correlations[graph.Offsets[i] + k] = neighbours[k].second;
+        }
+    }
+    return graph;
+}
+
+// Covariance matrix of a universe whose series list and delist while it streams. Series
+// live in slots; a delisted series frees its slot for the next listing. The co-moments of
+// slot pairs (i, j), i >= j, are packed row by row in the lower triangle, entry
+// i (i + 1) / 2 + j, so adding a slot appends a row, and the triangle is stored in fixed
+// pages: growing the universe allocates pages and never moves existing entries. Every pair
+// has its own count and Welford state, so series that start mid-stream only see the
+// observations both series of a pair share.
+class TDynamicCovarianceMatrix {
+private:
+    struct TPairMoments {
+        uint64_t Count;
+        double MeanX;
+        double MeanY;
+        double SumProducts;
+    };
+
+    static const size_t PageBits = 12;
+    static const size_t PageSize = (size_t) 1 << PageBits;
+
+    std::vector<std::unique_ptr<TPairMoments[]>> Pages;
+    std::vector<bool> Active;
+    std::vector<size_t> FreeSlots;
+    std::vector<size_t> Present;
+public:
+    // Slot of the new series; its pairs start empty.
+    size_t AddSeries() {
+        size_t slot;
+        if (!FreeSlots.empty()) {
+            slot = FreeSlots.back();
+            FreeSlots.pop_back();
+        } else {
+            slot = Active.size();
+            Active.push_back(false);
+            const size_t entries = PairIndex(slot, slot) + 1;
+            while (Pages.size() * PageSize < entries) {
+                Pages.emplace_back(new TPairMoments[PageSize]());
+            }
+        }
+
+        for (size_t other = 0; other < Active.size(); ++other) {
+            Pair(slot, other) = TPairMoments();
+        }
+        Active[slot] = true;
+        return slot;
+    }
+
+    void RemoveSeries(const size_t slot) {
+        CheckActive(slot);
+        Active[slot] = false;
+        FreeSlots.push_back(slot);
+    }
+
+    // One time step: values[slot] for every slot below SlotsCount(); NaN marks a series with
+    // no observation, and inactive slots are ignored.
+    void Add(const double* values) {
+        Present.clear();
+        for (size_t slot = 0; slot < Active.size(); ++slot) {
+            if (Active[slot] && !std::isnan(values[slot])) {
+                Present.push_back(slot);
+            }
+        }
+
+        for (size_t a = 0; a < Present.size(); ++a) {
+            const size_t i = Present[a];
+            for (size_t b = 0; b <= a; ++b) {
+                const size_t j = Present[b];
+                TPairMoments& moments = Pair(i, j);
+                ++moments.Count;
+                WelfordStep(moments.MeanX, moments.MeanY, moments.SumProducts, values[i], values[j], 1. / moments.Count);
+            }
+        }
+    }
+
+    // NaN for a pair without shared observations, e.g. a series just listed, as for an empty
+    // range of the prefix-sum index.
+    double Covariation(const size_t i, const size_t j) const {
+        const TPairMoments& moments = ActivePair(i, j);
+        if (!moments.Count) {
+            return std::nan("");
+        }
+        return moments.SumProducts / moments.Count;
+    }
+
+    // Observations shared by the two series.
+    uint64_t PairCount(const size_t i, const size_t j) const {
+        return ActivePair(i, j).Count;
+    }
+
+    bool IsActive(const size_t slot) const {
+        return slot < Active.size() && Active[slot];
+    }
+
+    size_t SlotsCount() const {
+        return Active.size();
+    }
+
+    size_t PagesCount() const {
+        return Pages.size();
+    }
+private:
+    static size_t PairIndex(const size_t i, const size_t j) {
+        const size_t row = std::max(i, j);
+        return row * (row + 1) / 2 + std::min(i, j);
+    }
+
+    TPairMoments& Pair(const size_t i, const size_t j) {
+        const size_t index = PairIndex(i, j);
+        return Pages[index >> PageBits][index & (PageSize - 1)];
+    }
+
+    const TPairMoments& Pair(const size_t i, const size_t j) const {
+        const size_t index = PairIndex(i, j);
+        return Pages[index >> PageBits][index & (PageSize - 1)];
+    }
+
+    // A freed slot's pairs are stale until the slot is reused, and slots past the table
+    // have no pages at all.
+    const TPairMoments& ActivePair(const size_t i, const size_t j) const {
+        CheckActive(i);
+        CheckActive(j);
+        return Pair(i, j);
+    }
+
+    void CheckActive(const size_t slot) const {
+        if (!IsActive(slot)) {
+            throw std::invalid_argument("series slot is not active");
+        }
+    }
+};
+
+const size_t TDynamicCovarianceMatrix::PageBits;
+const size_t TDynamicCovarianceMatrix::PageSize;
+
+double Error(const double target, const double value) {
+    return fabs(value - target) / fabs(target);
+}
+
+class TPrinter {
+private:
+    std::string Title;
+
+    std::vector<std::string> Columns;
+    std::vector<std::vector<std::string>> Rows;
+public:
+    TPrinter(const std::string& title)
+        : Title(title)
+    {
+    }
+
+    void AddColumn(const std::string& name) {
+        Columns.push_back(name);
+    }
+
+    void AddRow() {
+        Rows.push_back(std::vector<std::string>());
+    }
+
+    template <class TValue>
+    void AddToRow(const TValue& value) {
+        std::stringstream ss;
+        ss.precision(10);
+        ss << value;
+        Rows.back().push_back(ss.str());
+    }
+
+    void Print() const {
+        auto printRow = [&](const std::vector<std::string>& row){
+            const size_t columnWidth = 25;
+
+            std::stringstream rowStream;
+            for (const std::string& element : row) {
+                PrintNextColumn(rowStream, element, columnWidth);
+            }
+
+            printf("%s\n", rowStream.str().c_str());
+        };
+
+        printf("%s\n", Title.c_str());
+        printRow(Columns);
+        for (const std::vector<std::string>& row : Rows) {
+            printRow(row);
+        }
+    }
+private:
+    template <class TValue>
+    void PrintNextColumn(std::stringstream& out, const TValue& value, size_t columnWidth) const {
+        const size_t startLength = out.str().size();
+        out << value;
+        const size_t currentLength = out.str().size();
+        for (size_t i = currentLength; i < startLength + columnWidth; ++i) {
+            out << " ";
+        }
+    }
+};
+
+// Every index and estimator is checked against the Welford (or Kahan) reference on the same
+// data; a row fails when its relative error exceeds the tolerance, or, for a zero reference,
+// when the value itself does.
+class TChecker {
+private:
+    TPrinter Printer;
+    size_t FailuresCount = 0;
+public:
+    TChecker()
+        : Printer("checks")
+    {
+        Printer.AddColumn("Check");
+        Printer.AddColumn("Reference");
+        Printer.AddColumn("Value");
+        Printer.AddColumn("Error");
+        Printer.AddColumn("Status");
+    }
+
+    void Check(const std::string& name, const double reference, const double value, const double tolerance) {
+        const double error = reference ? Error(reference, value) : fabs(value);
+        const bool passed = error <= tolerance;
+        FailuresCount += !passed;
+
+        Printer.AddRow();
+        Printer.AddToRow(name);
+        Printer.AddToRow(reference);
+        Printer.AddToRow(value);
+        Printer.AddToRow(error);
+        Printer.AddToRow(passed ? "ok" : "FAILED");
+    }
+
+    void Print() const {
+        Printer.Print();
+    }
+
+    size_t GetFailuresCount() const {
+        return FailuresCount;
+    }
+};
+
+// Noisy series around mean with y = x / 2 + noise, reproducible from the seed.
+struct TCheckSeries {
+    std::vector<double> Xs;
+    std::vector<double> Ys;
+
+    TCheckSeries(const size_t count, const double mean, const uint64_t seed)
+        : Xs(count)
+        , Ys(count)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            const double x = Uniform(seed, 2 * i);
+            Xs[i] = mean + x;
+            Ys[i] = mean + x / 2 + Uniform(seed, 2 * i + 1);
+        }
+    }
+
+    static double Uniform(const uint64_t seed, const uint64_t idx) {
+        return (MixBits(seed ^ MixBits(idx)) >> 11) / 4503599627370496. - 1.;
+    }
+};
+
+TWelfordCovariationCalculator ReferenceCalculator(const std::vector<double>& xs, const std::vector<double>& ys, const size_t begin, const size_t end) {
+    TWelfordCovariationCalculator calculator;
+    for (size_t i = begin; i < end; ++i) {
+        calculator.Add(xs[i], ys[i]);
+    }
+    return calculator;
+}
+
+void CheckPrefixSumIndex(TChecker& checker) {
+    const TCheckSeries series(100000, 1e7, 51);
+    const TPrefixSumCovariationIndex index(series.Xs, series.Ys, 1024);
+    checker.Check("PrefixSum[0, n)", ReferenceCalculator(series.Xs, series.Ys, 0, 100000).Covariation(), index.Covariation(0, 100000), 1e-8);
+    checker.Check("PrefixSum[1500, 77777)", ReferenceCalculator(series.Xs, series.Ys, 1500, 77777).Covariation(), index.Covariation(1500, 77777), 1e-8);
+    checker.Check("PrefixSum[2100, 2900)", ReferenceCalculator(series.Xs, series.Ys, 2100, 2900).Covariation(), index.Covariation(2100, 2900), 1e-8);
+
+    size_t thrownCount = 0;
+    const size_t misuses[][2] = { { 10, 5 }, { 0, 100001 }, { 200000, 200001 } };
+    for (const auto& misuse : misuses) {
+        try {
+            index.Covariation(misuse[0], misuse[1]);
+        } catch (const std::out_of_range&) {
+            ++thrownCount;
+        }
+    }
+    checker.Check("PrefixSum range throws", 3, thrownCount, 0);
+}
+
+void CheckSegmentTree(TChecker& checker) {
+    TCheckSeries series(10000, 1e5, 52);
+    TCovariationSegmentTree<> tree(series.Xs, series.Ys);
+    checker.Check("SegmentTree[37, 9001)", ReferenceCalculator(series.Xs, series.Ys, 37, 9001).Covariation(), tree.Covariation(37, 9001), 1e-10);
+
+    series.Xs[5000] += 3.;
+    series.Ys[5000] -= 2.;
+    tree.Update(5000, series.Xs[5000], series.Ys[5000]);
+    checker.Check("SegmentTree update", ReferenceCalculator(series.Xs, series.Ys, 100, 9900).Covariation(), tree.Covariation(100, 9900), 1e-10);
+
+    const TCovariationSegmentTree<TKahanCovariationCalculator> kahanTree(series.Xs, series.Ys);
+    checker.Check("SegmentTree<Kahan>", ReferenceCalculator(series.Xs, series.Ys, 0, 10000).Covariation(), kahanTree.Covariation(0, 10000), 1e-5);
+
+    const std::vector<double> empty;
+    const TCovariationSegmentTree<> emptyTree(empty, empty);
+    checker.Check("SegmentTree empty size", 0, emptyTree.Size(), 0);
+
+    size_t thrownCount = 0;
+    const size_t misuses[][2] = { { 10, 5 }, { 0, 10001 }, { 20000, 20001 } };
+    for (const auto& misuse : misuses) {
+        try {
+            tree.Covariation(misuse[0], misuse[1]);
+        } catch (const std::out_of_range&) {
+            ++thrownCount;
+        }
+    }
+    try {
+        tree.Update(10000, 1., 1.);
+    } catch (const std::out_of_range&) {
+        ++thrownCount;
+    }
+    try {
+        emptyTree.Query(0, 1);
+    } catch (const std::out_of_range&) {
+        ++thrownCount;
+    }
+    checker.Check("SegmentTree range throws", 5, thrownCount, 0);
+}
+
+void CheckRollupStore(TChecker& checker) {
+    const size_t count = 3 * 24 * 60 * 6;
+    const int64_t step = 10 * 1000;
+    const TCheckSeries series(count, 1e5, 53);
+
+    TCovariationRollupStore store;
+    for (size_t i = 0; i < count; ++i) {
+        store.Add(i * step, series.Xs[i], series.Ys[i]);
+    }
+
+    const int64_t from = 7 * 60 * 1000;
+    const int64_t to = 2 * 24 * 60 * 60 * 1000 + 13 * 60 * 1000;
+    checker.Check("Rollup[7m, 2d 13m)", ReferenceCalculator(series.Xs, series.Ys, from / step, to / step).Covariation(), store.Covariation(from, to), 1e-10);
+}
+
+void CheckColumnarFile(TChecker& checker) {
+    const size_t count = 100000;
+    const TCheckSeries series(count, 1e5, 54);
+    const std::string path = "check-columnar.tmp";
+    {
+        TColumnarFileWriter writer(path, 4096);
+        for (size_t i = 0; i < count; ++i) {
+            writer.Add(i, series.Xs[i], series.Ys[i]);
+        }
+    }
+
+    TColumnarQuery query;
+    query.From = 10000;
+    query.To = 90000;
+    query.MaxX = 1e5 + 0.5;
+    TWelfordCovariationCalculator reference;
+    for (size_t i = query.From; i < (size_t) query.To; ++i) {
+        if (series.Xs[i] <= query.MaxX) {
+            reference.Add(series.Xs[i], series.Ys[i]);
+        }
+    }
+
+    const TColumnarFileReader reader(path);
+    checker.Check("Columnar whole file", ReferenceCalculator(series.Xs, series.Ys, 0, count).Covariation(), reader.Covariation(), 1e-10);
+    checker.Check("Columnar filtered", reference.Covariation(), reader.Covariation(query), 1e-10);
+    std::remove(path.c_str());
+
+    std::string error;
+    try {
+        TColumnarFileReader missing(path);
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    checker.Check("Columnar missing file", 0, error.compare(0, 14, "failed to open") != 0, 0);
+
+    // The same NaN-holed range, answered with chunks aligned differently, must not depend on
+    // which chunks come from their headers.
+    TColumnarQuery nanQuery;
+    nanQuery.From = 8192;
+    nanQuery.To = 77777;
+    TWelfordCovariationCalculator nanReference;
+    for (const size_t chunkSize : { 4096, 1000 }) {
+        TColumnarFileWriter writer(path, chunkSize);
+        for (size_t i = 0; i < count; ++i) {
+            const bool missing = i % 97 == 0;
+            writer.Add(i, missing ? NAN : series.Xs[i], series.Ys[i]);
+            if (!missing && (int64_t) i >= nanQuery.From && (int64_t) i < nanQuery.To && chunkSize == 4096) {
+                nanReference.Add(series.Xs[i], series.Ys[i]);
+            }
+        }
+        writer.Finish();
+        const TColumnarFileReader nanReader(path);
+        checker.Check("Columnar NaN rows " + std::to_string(chunkSize), nanReference.Covariation(), nanReader.Covariation(nanQuery), 1e-10);
+    }
+
+    {
+        std::fstream file(path.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(-(std::streamoff) (2 * sizeof(uint64_t) + sizeof(ColumnarFileMagic)), std::ios::end);
+        WriteValue<uint64_t>(file, std::numeric_limits<uint64_t>::max() / 2);
+    }
+    error.clear();
+    try {
+        TColumnarFileReader corrupted(path);
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    checker.Check("Columnar bad footer", 0, error.compare(0, 26, "corrupted columnar footer:") != 0, 0);
+    std::remove(path.c_str());
+}
+
+void CheckGorilla(TChecker& checker) {
+    const size_t count = 100000;
+    TCheckSeries series(count, 1e5, 55);
+    TGorillaEncoder xEncoder;
+    TGorillaEncoder yEncoder;
+    for (size_t i = 0; i < count; ++i) {
+        series.Xs[i] = round(series.Xs[i] * 100) / 100;
+        series.Ys[i] = i % 3 ? series.Ys[i - 1] : series.Ys[i];
+        xEncoder.Add(series.Xs[i]);
+        yEncoder.Add(series.Ys[i]);
+    }
+
+    TWelfordCovariationCalculator welford;
+    AddGorilla(xEncoder.GetStream(), yEncoder.GetStream(), welford);
+    TKahanCovariationCalculator kahan;
+    AddGorilla(xEncoder.GetStream(), yEncoder.GetStream(), kahan);
+
+    const double reference = ReferenceCalculator(series.Xs, series.Ys, 0, count).Covariation();
+    checker.Check("Gorilla Welford", reference, welford.Covariation(), 1e-10);
+    checker.Check("Gorilla Kahan", reference, kahan.Covariation(), 1e-5);
+}
+
+// Written by pyarrow 26.0.0: columns t (int64), x and y (float64) in two record batches of six
+// rows, where x[i] = 1e5 + (7i mod 5) / 4, y[i] = 1e5 + (3i mod 4) / 2 and y is null at rows 4
+// and 9. Regenerate with:
+//
+//   t = pa.array(range(12), pa.int64())
+//   x = pa.array([1e5 + (7 * i % 5) / 4 for i in range(12)])
+//   y = pa.array([None if i in (4, 9) else 1e5 + (3 * i % 4) / 2 for i in range(12)])
+//   table = pa.table({"t": t, "x": x, "y": y})
+//   with pa.ipc.new_file(path, table.schema) as writer:
+//       writer.write_table(table, max_chunksize=6)
+static const uint8_t PyArrowFixture[] = {
+    0x41, 0x52, 0x52, 0x4f, 0x57, 0x31, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xd8, 0x00, 0x00, 0x00,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x0c, 0x00, 0x06, 0x00, 0x05, 0x00, 0x08, 0x00,
+    0x0a, 0x00, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x08, 0x00, 0x08, 0x00,
+    0x00, 0x00, 0x04, 0x00, 0x08, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+    0x70, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0xac, 0xff, 0xff, 0xff,
+    0x00, 0x00, 0x01, 0x03, 0x10, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x79, 0x00, 0x00, 0x00, 0xda, 0xff, 0xff, 0xff,
+    0x00, 0x00, 0x02, 0x00, 0xd4, 0xff, 0xff, 0xff, 0x00, 0x00, 0x01, 0x03, 0x10, 0x00, 0x00, 0x00,
+    0x18, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x78, 0x00, 0x06, 0x00, 0x08, 0x00, 0x06, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
+    0x10, 0x00, 0x14, 0x00, 0x08, 0x00, 0x06, 0x00, 0x07, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x10, 0x00,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x10, 0x00, 0x00, 0x00, 0x1c, 0x00, 0x00, 0x00,
+    0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x74, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x0c, 0x00, 0x08, 0x00, 0x07, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xe8, 0x00, 0x00, 0x00,
+    0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x16, 0x00, 0x06, 0x00, 0x05, 0x00,
+    0x08, 0x00, 0x0c, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x03, 0x04, 0x00, 0x18, 0x00, 0x00, 0x00,
+    0x98, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x18, 0x00, 0x0c, 0x00,
+    0x04, 0x00, 0x08, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x7c, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x68, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x10, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x04, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x6a, 0xf8, 0x40, 0xef, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x18, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x6a, 0xf8, 0x40,
+    0xff, 0xff, 0xff, 0xff, 0xe8, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x0c, 0x00, 0x16, 0x00, 0x06, 0x00, 0x05, 0x00, 0x08, 0x00, 0x0c, 0x00, 0x0c, 0x00, 0x00, 0x00,
+    0x00, 0x03, 0x04, 0x00, 0x18, 0x00, 0x00, 0x00, 0x98, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x0a, 0x00, 0x18, 0x00, 0x0c, 0x00, 0x04, 0x00, 0x08, 0x00, 0x0a, 0x00, 0x00, 0x00,
+    0x7c, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x68, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x10, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x04, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40,
+    0x37, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x6a, 0xf8, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x08, 0x6a, 0xf8, 0x40, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+    0x10, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x14, 0x00, 0x06, 0x00, 0x08, 0x00, 0x0c, 0x00, 0x10, 0x00,
+    0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x50, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00,
+    0x04, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0xe8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xf0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x98, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x70, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x98, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x08, 0x00, 0x00, 0x00, 0x04, 0x00, 0x08, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x00, 0x70, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+    0xac, 0xff, 0xff, 0xff, 0x00, 0x00, 0x01, 0x03, 0x10, 0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00,
+    0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x79, 0x00, 0x00, 0x00,
+    0xda, 0xff, 0xff, 0xff, 0x00, 0x00, 0x02, 0x00, 0xd4, 0xff, 0xff, 0xff, 0x00, 0x00, 0x01, 0x03,
+    0x10, 0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x78, 0x00, 0x06, 0x00, 0x08, 0x00, 0x06, 0x00, 0x06, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x02, 0x00, 0x10, 0x00, 0x14, 0x00, 0x08, 0x00, 0x06, 0x00, 0x07, 0x00, 0x0c, 0x00,
+    0x00, 0x00, 0x10, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x10, 0x00, 0x00, 0x00,
+    0x1c, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+    0x74, 0x00, 0x00, 0x00, 0x08, 0x00, 0x0c, 0x00, 0x08, 0x00, 0x07, 0x00, 0x08, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x40, 0x00, 0x00, 0x00, 0x18, 0x01, 0x00, 0x00, 0x41, 0x52, 0x52, 0x4f,
+    0x57, 0x31,
+};
+
+void WriteFile(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+void CheckArrowFile(TChecker& checker) {
+    TWelfordCovariationCalculator reference;
+    for (size_t i = 0; i < 12; ++i) {
+        if (i != 4 && i != 9) {
+            reference.Add(1e5 + (7 * i % 5) * 0.25, 1e5 + (3 * i % 4) * 0.5);
+        }
+    }
+
+    const std::string path = "check-arrow.tmp";
+    const std::vector<uint8_t> fixture(PyArrowFixture, PyArrowFixture + sizeof(PyArrowFixture));
+    WriteFile(path, fixture);
+    {
+        const TArrowFileReader reader(path);
+        TWelfordCovariationCalculator calculator;
+        reader.AddColumns("x", "y", calculator);
+        checker.Check("Arrow pyarrow fixture", reference.Covariation(), calculator.Covariation(), 1e-12);
+    }
+
+    // x[1] lives at byte 528 and the type tag of column t in the footer schema at byte 1259.
+    const size_t nanOffset = 528;
+    const size_t typeOffset = 1259;
+    {
+        std::vector<uint8_t> withNan = fixture;
+        const double nan = NAN;
+        memcpy(withNan.data() + nanOffset, &nan, sizeof(nan));
+        WriteFile(path, withNan);
+        const TArrowFileReader reader(path);
+        TWelfordCovariationCalculator calculator;
+        reader.AddColumns("x", "y", calculator);
+        TWelfordCovariationCalculator nanReference;
+        for (size_t i = 0; i < 12; ++i) {
+            if (i != 1 && i != 4 && i != 9) {
+                nanReference.Add(1e5 + (7 * i % 5) * 0.25, 1e5 + (3 * i % 4) * 0.5);
+            }
+        }
+        checker.Check("Arrow NaN rows", nanReference.Covariation(), calculator.Covariation(), 1e-12);
+    }
+    {
+        std::vector<uint8_t> withView = fixture;
+        withView[typeOffset] = 24;
+        WriteFile(path, withView);
+        const TArrowFileReader reader(path);
+        TWelfordCovariationCalculator calculator;
+        reader.AddColumns("x", "y", calculator);
+        checker.Check("Arrow after a view column", reference.Covariation(), calculator.Covariation(), 1e-12);
+    }
+    {
+        std::vector<uint8_t> withUnknown = fixture;
+        withUnknown[typeOffset] = 200;
+        WriteFile(path, withUnknown);
+        const TArrowFileReader reader(path);
+        size_t thrown = 0;
+        try {
+            TWelfordCovariationCalculator calculator;
+            reader.AddColumns("x", "y", calculator);
+        } catch (const std::runtime_error&) {
+            ++thrown;
+        }
+        checker.Check("Arrow unknown type throws", 1, thrown, 0);
+    }
+
+    // Flipped bits, in the footer on even trials and anywhere on odd ones, must either go
+    // unnoticed or throw; reading outside the mapping would crash the check instead.
+    const size_t trialsCount = 1000;
+    const size_t footerSize = 320;
+    size_t completedCount = 0;
+    for (size_t trial = 0; trial < trialsCount; ++trial) {
+        std::vector<uint8_t> corrupted = fixture;
+        const size_t begin = trial % 2 ? 0 : corrupted.size() - footerSize;
+        for (size_t flip = 0; flip < 3; ++flip) {
+            const uint64_t bit = begin * 8 + MixBits(trial * 3 + flip) % ((corrupted.size() - begin) * 8);
+            corrupted[bit / 8] ^= 1 << (bit % 8);
+        }
+        WriteFile(path, corrupted);
+        try {
+            const TArrowFileReader reader(path);
+            TWelfordCovariationCalculator calculator;
+            reader.AddColumns("x", "y", calculator);
+        } catch (const std::exception&) {
+        }
+        ++completedCount;
+    }
+    std::remove(path.c_str());
+    checker.Check("Arrow corrupted files", trialsCount, completedCount, 0);
+}
+
+void CheckBatchFilter(TChecker& checker) {
+    const size_t count = 10003;
+    const TCheckSeries series(count, 1e5, 57);
+    std::vector<int64_t> timestamps(count);
+    std::vector<int64_t> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        timestamps[i] = i;
+        keys[i] = i % 40;
+    }
+
+    TColumnBatch batch;
+    batch.Timestamps = timestamps.data();
+    batch.Keys = keys.data();
+    batch.Xs = series.Xs.data();
+    batch.Ys = series.Ys.data();
+    batch.Size = count;
+
+    for (const size_t keysCount : { 5, 30 }) {
+        std::vector<int64_t> selectedKeys;
+        for (size_t key = 0; key < keysCount; ++key) {
+            selectedKeys.push_back(key);
+        }
+
+        TWelfordCovariationCalculator reference;
+        for (size_t i = 0; i < count; ++i) {
+            if (series.Xs[i] >= 1e5 - 0.5 && series.Xs[i] <= 1e5 + 0.75 && timestamps[i] >= 123 && timestamps[i] < 9876 && keys[i] < (int64_t) keysCount) {
+                reference.Add(series.Xs[i], series.Ys[i]);
+            }
+        }
+
+        TWelfordCovariationCalculator calculator;
+        TBatchFilter().WithXRange(1e5 - 0.5, 1e5 + 0.75).WithTimestamps(123, 9876).WithKeys(selectedKeys).Apply(batch, calculator);
+        checker.Check("BatchFilter " + std::to_string(keysCount) + " keys", reference.Covariation(), calculator.Covariation(), 1e-10);
+    }
+}
+
+void CheckKeyedHashJoin(TChecker& checker) {
+    const std::string xPath = "check-join-x.tmp";
+    const std::string yPath = "check-join-y.tmp";
+    const TCheckSeries series(100 * 500, 1e5, 58);
+    TWelfordCovariationCalculator reference;
+    {
+        std::ofstream xOut(xPath.c_str());
+        std::ofstream yOut(yPath.c_str());
+        xOut.precision(17);
+        yOut.precision(17);
+        for (size_t date = 0; date < 100; ++date) {
+            for (size_t id = 0; id < 500; ++id) {
+                const size_t i = date * 500 + id;
+                xOut << date << " " << id << " " << series.Xs[i] << "\n";
+                if (id % 7) {
+                    yOut << date << " " << 499 - id << " " << series.Ys[date * 500 + 499 - id] << "\n";
+                }
+            }
+        }
+        for (size_t date = 0; date < 100; ++date) {
+            for (size_t id = 0; id < 500; ++id) {
+                if ((499 - id) % 7) {
+                    reference.Add(series.Xs[date * 500 + id], series.Ys[date * 500 + id]);
+                }
+            }
+        }
+    }
+
+    TWelfordCovariationCalculator calculator;
+    JoinKeyedSeries(xPath, yPath, calculator);
+    std::remove(xPath.c_str());
+    std::remove(yPath.c_str());
+    checker.Check("KeyedHashJoin", reference.Covariation(), calculator.Covariation(), 1e-10);
+
+    {
+        std::ofstream xOut(xPath.c_str());
+        std::ofstream yOut(yPath.c_str());
+        xOut << "0 1 1.5\n0 2 2.5\n\n0 3 nan\n0 4 4.5\n";
+        yOut << "0 1 1.5\n0 2 2.5\n0 3 3.5\n0 4 4.5\n";
     }
+    std::string error;
+    try {
+        TWelfordCovariationCalculator corrupted;
+        JoinKeyedSeries(xPath, yPath, corrupted);
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    std::remove(xPath.c_str());
+    std::remove(yPath.c_str());
+    checker.Check("KeyedHashJoin bad line", 0, error != "malformed row at " + xPath + ":4", 0);
+}
 
-    TKahanAccumulator& operator += (const TKahanAccumulator& other) {
-        return *this += (double)other;
+void CheckResultCache(TChecker& checker) {
+    const TCheckSeries series(100000, 1e5, 59);
+    TDatasetId dataset;
+    dataset.Path = "check-series";
+    size_t scannedCount = 0;
+    const auto scan = [&](const size_t begin, const size_t end) {
+        scannedCount += end - begin;
+        return ReferenceCalculator(series.Xs, series.Ys, begin, end);
+    };
+
+    TCovariationResultCache<> cache(1 << 20, 1024);
+    cache.Query(dataset, 500, 60000, scan);
+    const double covariation = cache.Query(dataset, 3000, 70000, scan).Covariation();
+    cache.Query(dataset, 3000, 70000, scan);
+    checker.Check("ResultCache overlap", ReferenceCalculator(series.Xs, series.Ys, 3000, 70000).Covariation(), covariation, 1e-10);
+    checker.Check("ResultCache scanned rows", 59500 + 72 + 10 * 1024 + 368, scannedCount, 0);
+    checker.Check("ResultCache query hits", 1, cache.GetQueryHits(), 0);
+    checker.Check("ResultCache query misses", 2, cache.GetQueryMisses(), 0);
+    checker.Check("ResultCache block hits", 55, cache.GetBlockHits(), 0);
+    checker.Check("ResultCache block misses", 57 + 10, cache.GetBlockMisses(), 0);
+}
+
+void CheckCorrections(TChecker& checker) {
+    const size_t count = 100000;
+    TCheckSeries series(count, 1e5, 60);
+    std::vector<uint8_t> present(count, 1);
+    TCorrectableCovariationStore store(4096);
+    for (size_t i = 0; i < count; ++i) {
+        store.Add(series.Xs[i], series.Ys[i]);
+    }
+    for (size_t correction = 0; correction < 20000; ++correction) {
+        const size_t idx = MixBits(correction) % count;
+        if (correction % 4) {
+            series.Xs[idx] += TCheckSeries::Uniform(61, correction);
+            series.Ys[idx] -= TCheckSeries::Uniform(62, correction);
+            store.Replace(idx, series.Xs[idx], series.Ys[idx]);
+            present[idx] = 1;
+        } else {
+            store.Remove(idx);
+            present[idx] = 0;
+        }
     }
 
-    operator double() const {
-        return Sum + Addition;
+    TWelfordCovariationCalculator reference;
+    for (size_t i = 0; i < count; ++i) {
+        if (present[i]) {
+            reference.Add(series.Xs[i], series.Ys[i]);
+        }
     }
-};
+    checker.Check("Correctable store", reference.Covariation(), store.Covariation(), 1e-10);
 
-class ICovariationCalculator {
-private:
-public:
-    virtual void Add(const double x, const double y) = 0;
-    virtual double Covariation() const = 0;
-    virtual std::string Name() const = 0;
-};
+    // Chunks repeat the same xs with y = x and y = -x around the mean in turn, so the total
+    // co-moment cancels to rounding noise; re-sent corrections must not re-merge the total
+    // every time.
+    const size_t cancellingCount = 24 * 4096;
+    TCorrectableCovariationStore cancelling(4096);
+    for (size_t i = 0; i < cancellingCount; ++i) {
+        const double x = TCheckSeries::Uniform(160, i % 4096);
+        cancelling.Add(1e5 + x, 1e5 + (i / 4096 % 2 ? -x : x));
+    }
+    for (size_t correction = 0; correction < 20000; ++correction) {
+        const size_t idx = MixBits(correction) % cancellingCount;
+        const double x = TCheckSeries::Uniform(160, idx % 4096);
+        cancelling.Replace(idx, 1e5 + x, 1e5 + (idx / 4096 % 2 ? -x : x));
+    }
+    checker.Check("Correctable remerges", 1, cancelling.GetRemergedTotalsCount(), 0);
 
-template <class TAccumulatorType>
-class TTypedCovariationCalculator : public ICovariationCalculator {
-private:
-    size_t Count = 0;
-    TAccumulatorType SumX = 0.;
-    TAccumulatorType SumY = 0.;
-    TAccumulatorType SumProducts = 0.;
-public:
-    void Add(const double x, const double y) override {
-        ++Count;
-        SumX += x;
-        SumY += y;
-        SumProducts += x * y;
+    size_t thrownCount = 0;
+    try {
+        store.Replace(count, 1., 1.);
+    } catch (const std::out_of_range&) {
+        ++thrownCount;
     }
+    try {
+        store.Remove(count);
+    } catch (const std::out_of_range&) {
+        ++thrownCount;
+    }
+    checker.Check("Correctable index throws", 2, thrownCount, 0);
 
-    double Covariation() const override {
-        return ((double) SumProducts - (double) SumX * (double) SumY / Count) / Count;
+    TKahanCovariationCalculator kahan;
+    kahan.AddBatch(series.Xs.data(), series.Ys.data(), count);
+    for (size_t i = count / 2; i < count; ++i) {
+        kahan.Remove(series.Xs[i], series.Ys[i]);
     }
+    checker.Check("Kahan Remove", ReferenceCalculator(series.Xs, series.Ys, 0, count / 2).Covariation(), kahan.Covariation(), 1e-5);
 
-    std::string Name() const override;
-};
+    bool thrown = false;
+    try {
+        TWelfordCovariationCalculator().Remove(1., 1.);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    checker.Check("Remove from empty throws", 1, thrown, 0);
+}
 
-using TDummyCovariationCalculator = TTypedCovariationCalculator<long double>;
-using TKahanCovariationCalculator = TTypedCovariationCalculator<TKahanAccumulator>;
+// Sums of xs and of xs * ys rounded once from double-double accumulation.
+TKahanSums ExactSums(const double* xs, const double* ys, const size_t count) {
+    TDoubleDouble sumX;
+    TDoubleDouble sumY;
+    TDoubleDouble sumProducts;
+    for (size_t i = 0; i < count; ++i) {
+        sumX += xs[i];
+        sumY += ys[i];
+        sumProducts += TDoubleDouble(xs[i]) * TDoubleDouble(ys[i]);
+    }
 
-template <>
-std::string TDummyCovariationCalculator::Name() const {
-    return "Dummy";
-};
+    TKahanSums sums;
+    sums.SumX = sumX;
+    sums.SumY = sumY;
+    sums.SumProducts = sumProducts;
+    return sums;
+}
 
-template <>
-std::string TKahanCovariationCalculator::Name() const {
-    return "Kahan";
-};
+// Scalar chains and four-wide lanes are left holding +-1 with the 1e-17 terms only in their
+// compensations; once the ones cancel the total is nothing but the merged compensations.
+static const double CompensatedXs[] = { 1., 1., -1., -1., 1e-17, 1e-17, 1e-17, 1e-17 };
+static const double CompensatedYs[] = { 1., 1., 1., 1., 1., 1., 1., 1. };
 
-class TWelfordCovariationCalculator : public ICovariationCalculator {
-private:
-    size_t Count = 0;
-    double MeanX = 0.;
-    double MeanY = 0.;
-    double SumProducts = 0.;
-public:
-    void Add(const double x, const double y) override {
-        ++Count;
-        MeanX += (x - MeanX) / Count;
-        SumProducts += (x - MeanX) * (y - MeanY);
-        MeanY += (y - MeanY) / Count;
+void CheckSimdKernels(TChecker& checker) {
+    const size_t count = 100003;
+    const TCheckSeries series(count, 1e5, 61);
+    const double reference = ReferenceCalculator(series.Xs, series.Ys, 0, count).Covariation();
+    const TKahanSums exact = ExactSums(series.Xs.data(), series.Ys.data(), count);
+    const TKahanSums compensatedExact = ExactSums(CompensatedXs, CompensatedYs, 8);
+    for (size_t level = 0; level <= (size_t) DetectSimdLevel(); ++level) {
+        const TSimdKernels& kernels = SimdKernels((ESimdLevel) level);
+
+        TWelfordLanes lanes;
+        kernels.WelfordLanes(series.Xs.data(), series.Ys.data(), count, lanes);
+        TWelfordCovariationCalculator welford;
+        for (size_t lane = 0; lane < lanes.Width; ++lane) {
+            welford.Merge(TWelfordCovariationCalculator(lanes.Count, lanes.MeanX[lane], lanes.MeanY[lane], lanes.SumProducts[lane]));
+        }
+        welford.Merge(ReferenceCalculator(series.Xs, series.Ys, lanes.Count * lanes.Width, count));
+        checker.Check(std::string("Welford ") + kernels.Name, reference, welford.Covariation(), 1e-10);
+
+        TKahanSums sums;
+        kernels.KahanSums(series.Xs.data(), series.Ys.data(), count, sums);
+        checker.Check(std::string("Kahan ") + kernels.Name, exact.SumProducts, sums.SumProducts, 1e-16);
+
+        kernels.KahanSums(CompensatedXs, CompensatedYs, 8, sums);
+        checker.Check(std::string("Kahan merge ") + kernels.Name, compensatedExact.SumX, sums.SumX, 1e-15);
     }
+}
 
-    double Covariation() const override {
-        return SumProducts / Count;
+void CheckScalarChains(TChecker& checker) {
+    const size_t count = 100003;
+    const TCheckSeries series(count, 1e3, 62);
+    const double reference = ReferenceCalculator(series.Xs, series.Ys, 0, count).Covariation();
+
+    TDummyCovariationCalculator dummy;
+    dummy.AddBatch(series.Xs.data(), series.Ys.data(), count);
+    checker.Check("Dummy AddBatch", reference, dummy.Covariation(), 1e-8);
+
+    TDoubleDoubleCovariationCalculator doubleDouble;
+    doubleDouble.AddBatch(series.Xs.data(), series.Ys.data(), count);
+    checker.Check("DoubleDouble AddBatch", reference, doubleDouble.Covariation(), 1e-10);
+
+    TKahanSums sums;
+    KahanSumsScalar(series.Xs.data(), series.Ys.data(), count, sums);
+    checker.Check("Kahan chains", ExactSums(series.Xs.data(), series.Ys.data(), count).SumProducts, sums.SumProducts, 1e-16);
+    KahanSumsScalar(CompensatedXs, CompensatedYs, 8, sums);
+    checker.Check("Kahan chain merge", ExactSums(CompensatedXs, CompensatedYs, 8).SumX, sums.SumX, 1e-15);
+}
+
+void CheckNarrowInputs(TChecker& checker) {
+    const size_t count = 10007;
+    const TCheckSeries series(count, 100., 63);
+    std::vector<float> floatXs(count);
+    std::vector<float> floatYs(count);
+    std::vector<TBFloat16> bfloatXs(count);
+    std::vector<TBFloat16> bfloatYs(count);
+    std::vector<THalf> halfXs(count);
+    std::vector<THalf> halfYs(count);
+    std::vector<double> widenedXs(count);
+    std::vector<double> widenedYs(count);
+    for (size_t i = 0; i < count; ++i) {
+        floatXs[i] = series.Xs[i];
+        floatYs[i] = series.Ys[i];
+        uint32_t bits;
+        memcpy(&bits, &floatXs[i], sizeof(bits));
+        bfloatXs[i].Bits = bits >> 16;
+        memcpy(&bits, &floatYs[i], sizeof(bits));
+        bfloatYs[i].Bits = bits >> 16;
+        // 1 + m / 1024 with the x mantissa and half of it added to y.
+        const uint16_t mantissa = MixBits(i) % 1024;
+        halfXs[i].Bits = 15 << 10 | mantissa;
+        halfYs[i].Bits = 15 << 10 | (mantissa / 2 + MixBits(i + count) % 512);
     }
 
-    std::string Name() const override {
-        return "Welford";
+    const auto check = [&](const std::string& name, const std::function<void(ICovariationCalculator&)>& add, const std::function<double(size_t, bool)>& widen) {
+        for (size_t i = 0; i < count; ++i) {
+            widenedXs[i] = widen(i, true);
+            widenedYs[i] = widen(i, false);
+        }
+        TWelfordCovariationCalculator calculator;
+        add(calculator);
+        checker.Check(name, ReferenceCalculator(widenedXs, widenedYs, 0, count).Covariation(), calculator.Covariation(), 1e-12);
+    };
+    check("float AddBatch",
+        [&](ICovariationCalculator& calculator) { calculator.AddBatch(floatXs.data(), floatYs.data(), count); },
+        [&](const size_t i, const bool x) { return (double) (x ? floatXs[i] : floatYs[i]); });
+    check("bfloat16 AddBatch",
+        [&](ICovariationCalculator& calculator) { calculator.AddBatch(bfloatXs.data(), bfloatYs.data(), count); },
+        [&](const size_t i, const bool x) { return (double) (float) (x ? bfloatXs[i] : bfloatYs[i]); });
+    check("half AddBatch",
+        [&](ICovariationCalculator& calculator) { calculator.AddBatch(halfXs.data(), halfYs.data(), count); },
+        [&](const size_t i, const bool x) { return (double) (float) (x ? halfXs[i] : halfYs[i]); });
+}
+
+double Correlation(const double* xs, const double* ys, const size_t count) {
+    TWelfordCovariationCalculator covariation;
+    TWelfordCovariationCalculator xVariance;
+    TWelfordCovariationCalculator yVariance;
+    for (size_t i = 0; i < count; ++i) {
+        covariation.Add(xs[i], ys[i]);
+        xVariance.Add(xs[i], xs[i]);
+        yVariance.Add(ys[i], ys[i]);
     }
-};
+    return covariation.Covariation() / sqrt(xVariance.Covariation() * yVariance.Covariation());
+}
 
-double Error(const double target, const double value) {
-    return fabs(value - target) / fabs(target);
+// Replica streams must be independent: the largest correlation between the weights of two
+// replicas, also when one of them is lagged by a few draws, stays at the sampling noise.
+void CheckPoissonBootstrap(TChecker& checker) {
+    const size_t count = 20000;
+    const size_t replicasCount = 8;
+    const size_t maxLag = 8;
+    const TCheckSeries series(count, 1e5, 64);
+
+    TPoissonBootstrapCovariationCalculator bootstrap(replicasCount, 64);
+    std::vector<std::vector<double>> weights(replicasCount, std::vector<double>(count));
+    for (size_t i = 0; i < count; ++i) {
+        bootstrap.Add(series.Xs[i], series.Ys[i]);
+        for (size_t replica = 0; replica < replicasCount; ++replica) {
+            weights[replica][i] = bootstrap.ReplicaWeight(replica);
+        }
+    }
+    for (size_t replica = 0; replica < replicasCount; ++replica) {
+        std::adjacent_difference(weights[replica].begin(), weights[replica].end(), weights[replica].begin());
+    }
+
+    double maxCorrelation = 0.;
+    for (size_t first = 0; first < replicasCount; ++first) {
+        for (size_t second = 0; second < replicasCount; ++second) {
+            for (size_t lag = first == second; lag <= maxLag; ++lag) {
+                const double correlation = Correlation(weights[first].data(), weights[second].data() + lag, count - maxLag);
+                maxCorrelation = std::max(maxCorrelation, fabs(correlation));
+            }
+        }
+    }
+    checker.Check("Bootstrap estimate", ReferenceCalculator(series.Xs, series.Ys, 0, count).Covariation(), bootstrap.Covariation(), 1e-12);
+    checker.Check("Bootstrap weight corr", 0, maxCorrelation, 0.05);
 }
 
-class TPrinter {
-private:
-    std::string Title;
+void CheckJackknife(TChecker& checker) {
+    const size_t count = 10500;
+    const size_t blockSize = 1000;
+    const TCheckSeries series(count, 1e5, 65);
+    TJackknifeCovariationCalculator jackknife(blockSize);
+    jackknife.AddBatch(series.Xs.data(), series.Ys.data(), 3333);
+    jackknife.AddBatch(series.Xs.data() + 3333, series.Ys.data() + 3333, count - 3333);
 
-    std::vector<std::string> Columns;
-    std::vector<std::vector<std::string>> Rows;
-public:
-    TPrinter(const std::string& title)
-        : Title(title)
-    {
+    std::vector<double> references;
+    for (size_t begin = 0; begin < count; begin += blockSize) {
+        TWelfordCovariationCalculator rest = ReferenceCalculator(series.Xs, series.Ys, 0, begin);
+        rest.Merge(ReferenceCalculator(series.Xs, series.Ys, std::min(begin + blockSize, count), count));
+        references.push_back(rest.Covariation());
+    }
+    const double mean = std::accumulate(references.begin(), references.end(), 0.) / references.size();
+    double variance = 0.;
+    for (const double reference : references) {
+        variance += (reference - mean) * (reference - mean) * (references.size() - 1) / references.size();
     }
 
-    void AddColumn(const std::string& name) {
-        Columns.push_back(name);
+    checker.Check("Jackknife leave-out 3", references[3], jackknife.LeaveOneOutCovariations()[3], 1e-10);
+    checker.Check("Jackknife leave-out last", references.back(), jackknife.LeaveOneOutCovariations().back(), 1e-10);
+    checker.Check("Jackknife variance", variance, jackknife.Variance(), 1e-6);
+}
+
+void CheckRankCorrelations(TChecker& checker) {
+    const size_t count = 3000;
+    TCheckSeries series(count, 0., 66);
+    for (size_t i = 0; i < count; ++i) {
+        series.Xs[i] = round(series.Xs[i] * 20);
+        series.Ys[i] = round(series.Ys[i] * 20);
     }
 
-    void AddRow() {
-        Rows.push_back(std::vector<std::string>());
+    int64_t balance = 0;
+    uint64_t tiedX = 0;
+    uint64_t tiedY = 0;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            const int signX = (series.Xs[i] > series.Xs[j]) - (series.Xs[i] < series.Xs[j]);
+            const int signY = (series.Ys[i] > series.Ys[j]) - (series.Ys[i] < series.Ys[j]);
+            balance += signX * signY;
+            tiedX += !signX;
+            tiedY += !signY;
+        }
     }
+    const uint64_t pairsCount = (uint64_t) count * (count - 1) / 2;
+    const double tau = balance / sqrt((double) (pairsCount - tiedX) * (pairsCount - tiedY));
 
-    template <class TValue>
-    void AddToRow(const TValue& value) {
-        std::stringstream ss;
-        ss.precision(10);
-        ss << value;
-        Rows.back().push_back(ss.str());
+    TKendallTauCalculator streaming(16);
+    streaming.AddBatch(series.Xs.data(), series.Ys.data(), count);
+    checker.Check("KendallTau batch", tau, KendallTau(series.Xs.data(), series.Ys.data(), count), 1e-12);
+    checker.Check("KendallTau streaming", tau, streaming.Tau(), 1e-12);
+
+    const std::vector<double> xRanks = AverageRanks(series.Xs.data(), count);
+    const std::vector<double> yRanks = AverageRanks(series.Ys.data(), count);
+    checker.Check("SpearmanRho", Correlation(xRanks.data(), yRanks.data(), count), SpearmanRho(series.Xs.data(), series.Ys.data(), count), 1e-12);
+}
+
+// V-statistic distance correlation from the double-centred distance matrices, O(n^2).
+double DirectDistanceCorrelation(const std::vector<double>& xs, const std::vector<double>& ys) {
+    const size_t count = xs.size();
+    const auto centred = [count](const std::vector<double>& values) {
+        std::vector<double> distances(count * count);
+        std::vector<double> rowMeans(count, 0.);
+        double mean = 0.;
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = 0; j < count; ++j) {
+                distances[i * count + j] = fabs(values[i] - values[j]);
+                rowMeans[i] += distances[i * count + j] / count;
+            }
+            mean += rowMeans[i] / count;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = 0; j < count; ++j) {
+                distances[i * count + j] += mean - rowMeans[i] - rowMeans[j];
+            }
+        }
+        return distances;
+    };
+    const std::vector<double> a = centred(xs);
+    const std::vector<double> b = centred(ys);
+    const double covariance = std::inner_product(a.begin(), a.end(), b.begin(), 0.);
+    const double xVariance = std::inner_product(a.begin(), a.end(), a.begin(), 0.);
+    const double yVariance = std::inner_product(b.begin(), b.end(), b.begin(), 0.);
+    return sqrt(covariance / sqrt(xVariance * yVariance));
+}
+
+void CheckDistanceCorrelation(TChecker& checker) {
+    const size_t count = 600;
+    TCheckSeries series(count, 1e3, 67);
+    for (size_t i = 0; i < count; i += 7) {
+        series.Ys[i] = series.Ys[i + 1];
     }
+    const double reference = DirectDistanceCorrelation(series.Xs, series.Ys);
+    checker.Check("DistanceCorrelation", reference, DistanceCorrelation(series.Xs.data(), series.Ys.data(), count), 1e-9);
 
-    void Print() const {
-        auto printRow = [&](const std::vector<std::string>& row){
-            const size_t columnWidth = 25;
+    const TCheckSeries other(count, 0., 68);
+    const std::vector<TSeriesPair> pairs = {
+        { series.Xs.data(), series.Ys.data(), count },
+        { series.Xs.data(), other.Ys.data(), count },
+    };
+    const std::vector<double> threaded = DistanceCorrelations(pairs, 2);
+    checker.Check("DistanceCorrelations[0]", reference, threaded[0], 1e-9);
+    checker.Check("DistanceCorrelations[1]", DirectDistanceCorrelation(series.Xs, other.Ys), threaded[1], 1e-9);
+}
 
-            std::stringstream rowStream;
-            for (const std::string& element : row) {
-                PrintNextColumn(rowStream, element, columnWidth);
+void CheckRollingRegression(TChecker& checker) {
+    const size_t window = 250;
+    const size_t count = 100000;
+    const TCheckSeries series(count, 1e4, 68);
+    TRollingRegression regression(1, window);
+    for (size_t i = 0; i < count; ++i) {
+        regression.Add(&series.Xs[i], series.Ys[i]);
+    }
+
+    const TWelfordCovariationCalculator covariation = ReferenceCalculator(series.Xs, series.Ys, count - window, count);
+    const TWelfordCovariationCalculator variance = ReferenceCalculator(series.Xs, series.Xs, count - window, count);
+    const double slope = covariation.Covariation() / variance.Covariation();
+    const std::vector<double> coefficients = regression.Coefficients();
+    checker.Check("RollingRegression slope", slope, coefficients[1], 1e-8);
+    checker.Check("RollingRegression alpha", covariation.GetMeanY() - slope * covariation.GetMeanX(), coefficients[0], 1e-8);
+}
+
+// Correlated columns around mean whose level moves by drift over the series, checked against
+// a two-pass computation in long double.
+void CheckLedoitWolf(TChecker& checker, const std::string& name, const double mean, const double drift, const double tolerance) {
+    const size_t dimension = 5;
+    const size_t count = 2000;
+    std::vector<std::vector<double>> columns;
+    for (size_t i = 0; i < dimension; ++i) {
+        columns.push_back(TCheckSeries(count, 0., 69 + i).Ys);
+    }
+    for (size_t i = 1; i < dimension; ++i) {
+        std::transform(columns[i].begin(), columns[i].end(), columns[0].begin(), columns[i].begin(), std::plus<double>());
+    }
+    std::vector<double> samples(count * dimension);
+    for (size_t k = 0; k < count; ++k) {
+        for (size_t i = 0; i < dimension; ++i) {
+            samples[k * dimension + i] = columns[i][k] += mean + drift * k / count;
+        }
+    }
+
+    TLedoitWolfCovarianceCalculator calculator(dimension);
+    calculator.AddBatch(samples.data(), count);
+
+    std::vector<long double> means(dimension);
+    for (size_t i = 0; i < dimension; ++i) {
+        means[i] = std::accumulate(columns[i].begin(), columns[i].end(), (long double) 0.) / count;
+    }
+    std::vector<double> covariance(dimension * dimension);
+    double trace = 0.;
+    for (size_t i = 0; i < dimension; ++i) {
+        for (size_t j = 0; j < dimension; ++j) {
+            long double sumProducts = 0.;
+            for (size_t k = 0; k < count; ++k) {
+                sumProducts += (columns[i][k] - means[i]) * (columns[j][k] - means[j]);
             }
+            covariance[i * dimension + j] = sumProducts / count;
+        }
+        trace += covariance[i * dimension + i];
+    }
+    checker.Check(name + " cov(1, 3)", covariance[1 * dimension + 3], calculator.Covariation(1, 3), tolerance);
 
-            printf("%s\n", rowStream.str().c_str());
-        };
+    double dispersion = 0.;
+    for (size_t i = 0; i < dimension; ++i) {
+        for (size_t j = 0; j < dimension; ++j) {
+            const double target = i == j ? trace / dimension : 0.;
+            dispersion += (covariance[i * dimension + j] - target) * (covariance[i * dimension + j] - target);
+        }
+    }
+    long double spread = 0.;
+    for (size_t k = 0; k < count; ++k) {
+        for (size_t i = 0; i < dimension; ++i) {
+            for (size_t j = 0; j < dimension; ++j) {
+                const long double deviation = (columns[i][k] - means[i]) * (columns[j][k] - means[j]) - covariance[i * dimension + j];
+                spread += deviation * deviation / ((double) count * count);
+            }
+        }
+    }
+    checker.Check(name + " intensity", std::min((double) spread, dispersion) / dispersion, calculator.ShrinkageIntensity(), 10 * tolerance);
+}
 
-        printf("%s\n", Title.c_str());
-        printRow(Columns);
-        for (const std::vector<std::string>& row : Rows) {
-            printRow(row);
+void CheckLedoitWolf(TChecker& checker) {
+    CheckLedoitWolf(checker, "LedoitWolf", 1e3, 0., 1e-15);
+    CheckLedoitWolf(checker, "LedoitWolf@1e7", 1e7, 1e5, 1e-15);
+}
+
+// dimension series driven by three latent factors plus small noise, column-major.
+std::vector<std::vector<double>> LatentFactorColumns(const size_t dimension, const size_t count, const double mean, const uint64_t seed) {
+    std::vector<std::vector<double>> columns(dimension, std::vector<double>(count));
+    for (size_t k = 0; k < count; ++k) {
+        double factors[3];
+        for (size_t f = 0; f < 3; ++f) {
+            factors[f] = TCheckSeries::Uniform(seed + f, k);
+        }
+        for (size_t i = 0; i < dimension; ++i) {
+            columns[i][k] = mean + 0.01 * TCheckSeries::Uniform(seed + 3 + i, k);
+            for (size_t f = 0; f < 3; ++f) {
+                columns[i][k] += TCheckSeries::Uniform(seed + 100 + f, i) * factors[f];
+            }
         }
     }
-private:
-    template <class TValue>
-    void PrintNextColumn(std::stringstream& out, const TValue& value, size_t columnWidth) const {
-        const size_t startLength = out.str().size();
-        out << value;
-        const size_t currentLength = out.str().size();
-        for (size_t i = currentLength; i < startLength + columnWidth; ++i) {
-            out << " ";
+    return columns;
+}
+
+std::vector<double> RowMajorSamples(const std::vector<std::vector<double>>& columns) {
+    const size_t count = columns.front().size();
+    std::vector<double> samples(count * columns.size());
+    for (size_t k = 0; k < count; ++k) {
+        for (size_t i = 0; i < columns.size(); ++i) {
+            samples[k * columns.size() + i] = columns[i][k];
         }
     }
-};
+    return samples;
+}
+
+void CheckFrequentDirections(TChecker& checker) {
+    const size_t dimension = 30;
+    const size_t count = 3000;
+    const std::vector<std::vector<double>> columns = LatentFactorColumns(dimension, count, 100., 70);
+    const std::vector<double> samples = RowMajorSamples(columns);
+
+    TFrequentDirectionsCovariance sketch(dimension, 8);
+    sketch.AddBatch(samples.data(), count);
+    double maxError = 0.;
+    for (size_t i = 0; i < dimension; ++i) {
+        for (size_t j = 0; j <= i; ++j) {
+            const double error = fabs(sketch.Covariation(i, j) - ReferenceCalculator(columns[i], columns[j], 0, count).Covariation());
+            maxError = std::max(maxError, error);
+        }
+    }
+    checker.Check("FreqDirections err/bound", 0, maxError / sketch.ErrorBound(), 1.);
+
+    TFrequentDirectionsCovariance exact(dimension, 10);
+    exact.AddBatch(samples.data(), 20);
+    checker.Check("FreqDirections unshrunk", ReferenceCalculator(columns[4], columns[7], 0, 20).Covariation(), exact.Covariation(4, 7), 1e-10);
+}
+
+void CheckCountSketch(TChecker& checker) {
+    const size_t seriesCount = 20;
+    const size_t count = 5000;
+    const size_t width = 1024;
+    const std::vector<std::vector<double>> columns = LatentFactorColumns(seriesCount, count, 100., 71);
+    const std::vector<double> samples = RowMajorSamples(columns);
+
+    TCountSketchCovariation sketch(seriesCount, width);
+    sketch.AddBatch(samples.data(), count);
+    double maxError = 0.;
+    for (size_t i = 0; i < seriesCount; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            const TWelfordCovariationCalculator reference = ReferenceCalculator(columns[i], columns[j], 0, count);
+            const double correlation = reference.Covariation() / sqrt(sketch.Variance(i) * sketch.Variance(j));
+            maxError = std::max(maxError, fabs(sketch.Correlation(i, j) - correlation));
+        }
+    }
+    checker.Check("CountSketch corr error", 0, maxError, 4. / sqrt(width));
+    checker.Check("CountSketch variance", ReferenceCalculator(columns[5], columns[5], 0, count).Covariation(), sketch.Variance(5), 1e-10);
+}
+
+// Screening must find the planted pairs, five correlated and one anticorrelated, and report
+// their exact correlations.
+void CheckCorrelationScreener(TChecker& checker) {
+    const size_t seriesCount = 60;
+    const size_t length = 500;
+    std::vector<std::vector<double>> columns(seriesCount, std::vector<double>(length));
+    for (size_t i = 0; i < seriesCount; ++i) {
+        for (size_t t = 0; t < length; ++t) {
+            const double noise = TCheckSeries::Uniform(72 + i, t);
+            if (i % 2 && i <= 11) {
+                columns[i][t] = (i == 11 ? -columns[i - 1][t] : columns[i - 1][t]) + 0.2 * noise;
+            } else {
+                columns[i][t] = 50. + noise;
+            }
+        }
+    }
+    std::vector<const double*> series;
+    for (const std::vector<double>& column : columns) {
+        series.push_back(column.data());
+    }
+
+    const TCorrelationScreener screener(series, length);
+    const std::vector<TCorrelatedPair> pairs = screener.PairsAbove(0.9);
+    double maxError = 0.;
+    size_t plantedCount = 0;
+    for (const TCorrelatedPair& pair : pairs) {
+        const std::vector<double>& first = columns[pair.First];
+        const std::vector<double>& second = columns[pair.Second];
+        maxError = std::max(maxError, fabs(pair.Correlation - Correlation(first.data(), second.data(), length)));
+        plantedCount += std::min(pair.First, pair.Second) % 2 == 0 && std::max(pair.First, pair.Second) == std::min(pair.First, pair.Second) + 1;
+    }
+    checker.Check("Screener planted pairs", 6, plantedCount, 0);
+    checker.Check("Screener found pairs", 6, pairs.size(), 0);
+    checker.Check("Screener corr error", 0, maxError, 1e-10);
+}
+
+// Sparse rows against the Welford reference over their dense columns, implicit zeros included;
+// the largest admissible column id must keep its diagonal.
+void CheckSparseCovariance(TChecker& checker) {
+    const uint32_t features[] = { 0, 7, 1000, 123456, 0xFFFFFFFE };
+    const size_t featuresCount = sizeof(features) / sizeof(features[0]);
+    const size_t rowsCount = 20000;
+    std::vector<std::vector<double>> dense(featuresCount, std::vector<double>(rowsCount, 0.));
+    std::vector<size_t> offsets(1, 0);
+    std::vector<uint32_t> columns;
+    std::vector<double> values;
+    for (size_t row = 0; row < rowsCount; ++row) {
+        const double shared = TCheckSeries::Uniform(73, row);
+        for (size_t f = 0; f < featuresCount; ++f) {
+            if (TCheckSeries::Uniform(173 + f, row) < 0.) {
+                continue;
+            }
+            dense[f][row] = 10. + shared + TCheckSeries::Uniform(273 + f, row);
+            columns.push_back(features[f]);
+            values.push_back(dense[f][row]);
+        }
+        offsets.push_back(columns.size());
+    }
+
+    TSparseCovarianceCalculator calculator;
+    calculator.AddRows(offsets.data(), columns.data(), values.data(), rowsCount);
+    double maxError = 0.;
+    for (size_t i = 0; i < featuresCount; ++i) {
+        for (size_t j = 0; j <= i; ++j) {
+            const double reference = ReferenceCalculator(dense[i], dense[j], 0, rowsCount).Covariation();
+            maxError = std::max(maxError, Error(reference, calculator.Covariation(features[i], features[j])));
+        }
+    }
+    checker.Check("Sparse cov rel error", 0, maxError, 1e-10);
+    checker.Check("Sparse top column var", ReferenceCalculator(dense[4], dense[4], 0, rowsCount).Covariation(), calculator.Covariation(0xFFFFFFFE, 0xFFFFFFFE), 1e-10);
+    checker.Check("Sparse pairs count", featuresCount * (featuresCount + 1) / 2, calculator.PairsCount(), 0);
+
+    bool thrown = false;
+    try {
+        const uint32_t column = 0xFFFFFFFF;
+        const double value = 1.;
+        calculator.Add(&column, &value, 1);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    checker.Check("Sparse max column throws", 1, thrown, 0);
+}
+
+// Seven groups of series sharing a factor, over several partial tiles: the graph must hold
+// exactly the pairs whose Welford correlation reaches the threshold, both ways, sorted.
+void CheckCorrelationGraph(TChecker& checker) {
+    const size_t seriesCount = 75;
+    const size_t length = 400;
+    const double threshold = 0.5;
+    std::vector<std::vector<double>> columns(seriesCount, std::vector<double>(length));
+    std::vector<const double*> series;
+    for (size_t i = 0; i < seriesCount; ++i) {
+        for (size_t t = 0; t < length; ++t) {
+            columns[i][t] = 1000. + TCheckSeries::Uniform(74 + i % 7, t) * (i % 2 ? -1. : 1.) + 0.3 * TCheckSeries::Uniform(174 + i, t);
+        }
+        series.push_back(columns[i].data());
+    }
+
+    const TCorrelationGraph graph = ThresholdedCorrelationGraph(series, length, threshold, 16, 3);
+    size_t expectedEdges = 0;
+    size_t mismatches = 0;
+    double maxError = 0.;
+    for (size_t i = 0; i < seriesCount; ++i) {
+        size_t k = graph.Offsets[i];
+        for (size_t j = 0; j < seriesCount; ++j) {
+            const double reference = Correlation(columns[i].data(), columns[j].data(), length);
+            const bool expected = i != j && fabs(reference) >= threshold;
+            const bool found = k < graph.Offsets[i + 1] && graph.Columns[k] == j;
+            expectedEdges += expected;
+            mismatches += expected != found;
+            if (found) {
+                maxError = std::max(maxError, fabs(graph.Correlations[k++] - reference));
+            }
+        }
+        mismatches += graph.Offsets[i + 1] - k;
+    }
+    checker.Check("Graph edges", expectedEdges, graph.Columns.size(), 0);
+    checker.Check("Graph edge mismatches", 0, mismatches, 0);
+    checker.Check("Graph corr error", 0, maxError, 1e-12);
+}
+
+// Series list and delist mid-stream, reuse freed slots and grow the triangle past a page;
+// every live pair must match the Welford reference over the steps both series observed.
+void CheckDynamicCovariance(TChecker& checker) {
+    const size_t steps = 2000;
+    TDynamicCovarianceMatrix matrix;
+    std::vector<size_t> starts;
+    for (size_t slot = 0; slot < 100; ++slot) {
+        matrix.AddSeries();
+        starts.push_back(0);
+    }
+
+    std::vector<std::vector<double>> history(steps);
+    for (size_t t = 0; t < steps; ++t) {
+        if (t == 500) {
+            for (size_t slot = 10; slot < 20; ++slot) {
+                matrix.RemoveSeries(slot);
+            }
+        } else if (t == 800) {
+            for (size_t k = 0; k < 10; ++k) {
+                starts[matrix.AddSeries()] = t;
+            }
+        } else if (t == 1000) {
+            for (size_t k = 0; k < 5; ++k) {
+                matrix.AddSeries();
+                starts.push_back(t);
+            }
+        } else if (t == 1500) {
+            matrix.RemoveSeries(50);
+        }
+        const double shared = TCheckSeries::Uniform(75, t);
+        for (size_t slot = 0; slot < matrix.SlotsCount(); ++slot) {
+            const bool missing = TCheckSeries::Uniform(175 + slot, t) > 0.8;
+            history[t].push_back(missing ? NAN : 100. + shared + TCheckSeries::Uniform(275 + slot, t));
+        }
+        matrix.Add(history[t].data());
+    }
+
+    double maxError = 0.;
+    size_t countMismatches = 0;
+    for (size_t i = 0; i < matrix.SlotsCount(); ++i) {
+        for (size_t j = 0; j <= i && matrix.IsActive(i); ++j) {
+            if (!matrix.IsActive(j)) {
+                continue;
+            }
+            TWelfordCovariationCalculator reference;
+            for (size_t t = std::max(starts[i], starts[j]); t < steps; ++t) {
+                if (!std::isnan(history[t][i]) && !std::isnan(history[t][j])) {
+                    reference.Add(history[t][i], history[t][j]);
+                }
+            }
+            if (!reference.GetCount()) {
+                countMismatches += !std::isnan(matrix.Covariation(i, j));
+            } else {
+                maxError = std::max(maxError, Error(reference.Covariation(), matrix.Covariation(i, j)));
+            }
+            countMismatches += reference.GetCount() != matrix.PairCount(i, j);
+        }
+    }
+
+    checker.Check("Dynamic cov rel error", 0, maxError, 1e-10);
+    checker.Check("Dynamic count mismatches", 0, countMismatches, 0);
+    checker.Check("Dynamic pages", 2, matrix.PagesCount(), 0);
+
+    size_t thrownCount = 0;
+    const size_t misuses[][2] = { { 50, 1 }, { 3, matrix.SlotsCount() }, { 1000, 1000 } };
+    for (const auto& misuse : misuses) {
+        try {
+            matrix.Covariation(misuse[0], misuse[1]);
+        } catch (const std::invalid_argument&) {
+            ++thrownCount;
+        }
+        try {
+            matrix.PairCount(misuse[0], misuse[1]);
+        } catch (const std::invalid_argument&) {
+            ++thrownCount;
+        }
+    }
+    checker.Check("Dynamic bad slot throws", 6, thrownCount, 0);
+
+    // Listed into a freed slot after the last step: its pairs share no observations yet.
+    const size_t listed = matrix.AddSeries();
+    size_t emptyMismatches = matrix.PairCount(listed, 0) != 0;
+    emptyMismatches += !std::isnan(matrix.Covariation(listed, 0));
+    emptyMismatches += !std::isnan(matrix.Covariation(listed, listed));
+    checker.Check("Dynamic empty pair NaN", 0, emptyMismatches, 0);
+}
 
 int main() {
     double interestingMeans[] = { 100000, 10000000 };
@@ -219,5 +6382,33 @@ int main() {
         printf("\n\n");
     }
 
-    return 0;
+    TChecker checker;
+    CheckPrefixSumIndex(checker);
+    CheckSegmentTree(checker);
+    CheckRollupStore(checker);
+    CheckColumnarFile(checker);
+    CheckGorilla(checker);
+    CheckArrowFile(checker);
+    CheckBatchFilter(checker);
+    CheckKeyedHashJoin(checker);
+    CheckResultCache(checker);
+    CheckCorrections(checker);
+    CheckSimdKernels(checker);
+    CheckScalarChains(checker);
+    CheckNarrowInputs(checker);
+    CheckPoissonBootstrap(checker);
+    CheckJackknife(checker);
+    CheckRankCorrelations(checker);
+    CheckDistanceCorrelation(checker);
+    CheckRollingRegression(checker);
+    CheckLedoitWolf(checker);
+    CheckFrequentDirections(checker);
+    CheckCountSketch(checker);
+    CheckCorrelationScreener(checker);
+    CheckSparseCovariance(checker);
+    CheckCorrelationGraph(checker);
+    CheckDynamicCovariance(checker);
+    checker.Print();
+
+    return checker.GetFailuresCount() ? 1 : 0;
 }